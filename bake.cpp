@@ -0,0 +1,159 @@
+#include "bake.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace construct {
+
+// "IRB3"
+const uint32_t bake_magic = 0x33425249;
+
+// Floats per triangle corner.
+const int corner_size = 4;
+
+uint64_t hashTriangles(const std::vector<Triangle>& tris, int first, int count) {
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	auto feed = [&hash](const Eigen::Vector3f& v) {
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(v.data());
+		for(int i = 0; i < sizeof(float) * 3; i++) {
+			hash ^= p[i];
+			hash *= 1099511628211ull;
+		}
+	};
+	for(int i = first; i < first + count; i++) {
+		feed(tris[i].p0);
+		feed(tris[i].d1);
+		feed(tris[i].d2);
+	}
+	return hash;
+}
+
+
+IrradianceBake::IrradianceBake(const std::string& path, uint32_t sky_hash) :
+	mapped(nullptr), mapped_size(0), entries(nullptr), n_entries(0),
+	data(nullptr), n_data(0) {
+	const int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size >= sizeof(uint32_t) * 4) {
+		void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p != MAP_FAILED) {
+			mapped = p;
+			mapped_size = st.st_size;
+		}
+	}
+	close(fd);
+	if(!mapped) {
+		return;
+	}
+
+	const uint32_t* header = static_cast<const uint32_t*>(mapped);
+	const size_t header_size = sizeof(uint32_t) * 4 + sizeof(Entry) * header[1];
+	if(header[0] != bake_magic || header[2] != sky_hash || header_size > mapped_size ||
+		(mapped_size - header_size) % sizeof(float) != 0) {
+		return;
+	}
+	n_entries = header[1];
+	entries = reinterpret_cast<const Entry*>(header + 4);
+	data = reinterpret_cast<const float*>(static_cast<const char*>(mapped) + header_size);
+	n_data = (mapped_size - header_size) / sizeof(float);
+}
+
+IrradianceBake::~IrradianceBake() {
+	if(mapped) {
+		munmap(mapped, mapped_size);
+	}
+}
+
+int IrradianceBake::getNumEntries() const {
+	return n_entries;
+}
+
+bool IrradianceBake::apply(std::vector<Triangle>& tris, int first, int count,
+	std::vector<bool>& converged) const {
+	if(n_entries == 0) {
+		return false;
+	}
+
+	// Entries are sorted by hash.
+	const uint64_t hash = hashTriangles(tris, first, count);
+	auto it = std::lower_bound(entries, entries + n_entries, hash,
+		[](const Entry& entry, uint64_t hash) {
+			return entry.hash < hash;
+		});
+	for(; it != entries + n_entries && it->hash == hash; ++it) {
+		const Entry& entry = *it;
+		if(entry.n_tris != count ||
+			entry.offset + static_cast<size_t>(count) * 3 * corner_size > n_data) {
+			continue;
+		}
+
+		const float* corner = data + entry.offset;
+		converged.resize(3 * count);
+		for(int j = 0; j < count; j++) {
+			for(int k = 0; k < 3; k++) {
+				tris[first + j].setIrradiance(k, Colorf(corner[0], corner[1], corner[2]));
+				converged[3 * j + k] = corner[3] != 0;
+				corner += corner_size;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+void IrradianceBake::save(const std::string& path, uint32_t sky_hash,
+	const std::vector<Triangle>& tris, const std::vector<bool>& converged,
+	const std::vector<std::pair<int, int>>& ranges) {
+	assert(converged.size() == 3 * tris.size());
+	std::vector<Entry> entries;
+	std::vector<float> data;
+	for(const auto& range : ranges) {
+		Entry entry;
+		entry.hash = hashTriangles(tris, range.first, range.second);
+		entry.offset = data.size();
+		entry.n_tris = range.second;
+		entries.push_back(entry);
+
+		for(int i = range.first; i < range.first + range.second; i++) {
+			for(int k = 0; k < 3; k++) {
+				const Colorf ir = tris[i].getIrradiance(k);
+				data.insert(data.end(), {ir[0], ir[1], ir[2],
+					converged[3 * i + k] ? 1.0f : 0.0f});
+			}
+		}
+	}
+
+	std::stable_sort(entries.begin(), entries.end(),
+		[](const Entry& a, const Entry& b) {
+			return a.hash < b.hash;
+		});
+
+	// Write to a temporary file and rename, so that a running process that
+	// mapped the old file is not affected.
+	const std::string path_temp = path + ".tmp";
+	std::ofstream ofs(path_temp, std::ios::binary);
+	const uint32_t header[4] = {bake_magic, static_cast<uint32_t>(entries.size()), sky_hash, 0};
+	ofs.write(reinterpret_cast<const char*>(header), sizeof(header));
+	ofs.write(reinterpret_cast<const char*>(entries.data()), sizeof(Entry) * entries.size());
+	ofs.write(reinterpret_cast<const char*>(data.data()), sizeof(float) * data.size());
+	// Some errors only show up when flushing.
+	ofs.close();
+	if(!ofs || std::rename(path_temp.c_str(), path.c_str()) != 0) {
+		std::remove(path_temp.c_str());
+		throw "Failed to write irradiance bake";
+	}
+}
+
+}  // namespace
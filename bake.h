@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "light.h"
+
+namespace construct {
+
+// Hash of triangle geometry (not irradiance) in tris[first, first + count).
+uint64_t hashTriangles(const std::vector<Triangle>& tris, int first, int count);
+
+
+// Irradiance of triangle corners saved to a file, so that lighting doesn't
+// start from black on every launch.
+//
+// Each entry corresponds to a group of triangles (e.g. an object), and is
+// identified by hashTriangles of them. So entries remain valid when other
+// objects change. The whole file is only valid for the sky it was lit by.
+//
+// File layout (native endian; 4-byte aligned so that it's used in-place after mmap):
+//   uint32 magic, uint32 n_entries, uint32 sky_hash, uint32 reserved (0)
+//   n_entries * {uint64 hash, uint32 offset, uint32 n_tris} (sorted by hash)
+//   float data[]: entry's irradiance starts at data[offset],
+//     n_tris * 3 corners * (RGB, 1 if converged else 0)
+class IrradianceBake {
+public:
+	// Map the file. Empty when it doesn't exist, is broken, or was saved
+	// under a different sky_hash (Sky::getParameterHash).
+	IrradianceBake(const std::string& path, uint32_t sky_hash);
+	~IrradianceBake();
+
+	int getNumEntries() const;
+
+	// Set irradiance of tris[first, first + count) when the bake has them,
+	// and converged (per corner) to whether it had converged when saved.
+	// Return true when found.
+	bool apply(std::vector<Triangle>& tris, int first, int count,
+		std::vector<bool>& converged) const;
+
+	// Store irradiance of tris for given (first, count) groups.
+	// converged: per corner of tris
+	// Throws when the file can't be written.
+	static void save(const std::string& path, uint32_t sky_hash,
+		const std::vector<Triangle>& tris, const std::vector<bool>& converged,
+		const std::vector<std::pair<int, int>>& ranges);
+private:
+	class Entry {
+	public:
+		uint64_t hash;
+		uint32_t offset;
+		uint32_t n_tris;
+	};
+
+	void* mapped;
+	size_t mapped_size;
+
+	// Point into mapped.
+	const Entry* entries;
+	int n_entries;
+	const float* data;
+	size_t n_data;
+};
+
+}  // namespace
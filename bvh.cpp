@@ -0,0 +1,467 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <limits>
+
+namespace construct {
+
+// Traversal stack is fixed size, so the tree must not get deeper than this.
+const int max_depth = 60;
+
+const int n_bins = 16;
+
+const float inf = std::numeric_limits<float>::infinity();
+
+float surfaceArea(const Eigen::AlignedBox3f& box) {
+	if(box.isEmpty()) {
+		return 0;
+	}
+	const Eigen::Vector3f size = box.sizes();
+	return size.x() * size.y() + size.y() * size.z() + size.z() * size.x();
+}
+
+Eigen::AlignedBox3f getTriangleBounds(const Triangle& tri) {
+	Eigen::AlignedBox3f box;
+	for(int i = 0; i < 3; i++) {
+		box.extend(tri.getVertexPos(i));
+	}
+	return box;
+}
+
+// Return entry t of ray against box, or infinity when missed.
+float intersectBox(const Eigen::AlignedBox3f& box,
+	const Eigen::Vector3f& org, const Eigen::Vector3f& dir_inv, float t_max) {
+
+	const Eigen::Vector3f t0 = (box.min() - org).cwiseProduct(dir_inv);
+	const Eigen::Vector3f t1 = (box.max() - org).cwiseProduct(dir_inv);
+
+	const float t_enter = std::max(0.0f, t0.cwiseMin(t1).maxCoeff());
+	const float t_exit = std::min(t_max, t0.cwiseMax(t1).minCoeff());
+	return (t_enter <= t_exit) ? t_enter : inf;
+}
+
+void buildTreeNode(const std::vector<Eigen::AlignedBox3f>& bounds, int leaf_width,
+	std::vector<BVHNode>& nodes, std::vector<int>& order,
+	int node_index, int begin, int end, int depth) {
+
+	// Cost of testing n primitives in a leaf.
+	auto leaf_cost = [leaf_width](int n) {
+		return static_cast<float>((n + leaf_width - 1) / leaf_width);
+	};
+
+	Eigen::AlignedBox3f node_bounds;
+	Eigen::AlignedBox3f centroid_bounds;
+	for(int i = begin; i < end; i++) {
+		node_bounds.extend(bounds[order[i]]);
+		centroid_bounds.extend(bounds[order[i]].center());
+	}
+	nodes[node_index].bounds = node_bounds;
+	nodes[node_index].first = begin;
+	nodes[node_index].count = end - begin;
+
+	const int n = end - begin;
+	if(n <= leaf_width || depth >= max_depth) {
+		return;
+	}
+
+	// Find the best split among bin boundaries of all axes by
+	// cost = area(left) * leaf_cost(left) + area(right) * leaf_cost(right).
+	const Eigen::Vector3f extent = centroid_bounds.sizes();
+	auto get_bin = [&](int index, int axis) {
+		return std::min(n_bins - 1, static_cast<int>(
+			n_bins * (bounds[index].center()[axis] - centroid_bounds.min()[axis]) / extent[axis]));
+	};
+
+	float best_cost = inf;
+	int best_axis = -1;
+	int best_split = 0;
+	for(int axis = 0; axis < 3; axis++) {
+		if(extent[axis] <= 0) {
+			continue;
+		}
+
+		std::array<Eigen::AlignedBox3f, n_bins> bin_bounds;
+		std::array<int, n_bins> bin_counts;
+		bin_counts.fill(0);
+		for(int i = begin; i < end; i++) {
+			const int bin = get_bin(order[i], axis);
+			bin_bounds[bin].extend(bounds[order[i]]);
+			bin_counts[bin]++;
+		}
+
+		// Sweep from right to collect right-side stats, then from left.
+		std::array<float, n_bins> right_costs;
+		Eigen::AlignedBox3f accum_bounds;
+		int accum_count = 0;
+		for(int i = n_bins - 1; i > 0; i--) {
+			accum_bounds.extend(bin_bounds[i]);
+			accum_count += bin_counts[i];
+			right_costs[i] = surfaceArea(accum_bounds) * leaf_cost(accum_count);
+		}
+
+		accum_bounds.setEmpty();
+		accum_count = 0;
+		for(int i = 0; i < n_bins - 1; i++) {
+			accum_bounds.extend(bin_bounds[i]);
+			accum_count += bin_counts[i];
+			const float cost =
+				surfaceArea(accum_bounds) * leaf_cost(accum_count) + right_costs[i + 1];
+			if(accum_count > 0 && accum_count < n && cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i + 1;
+			}
+		}
+	}
+
+	// Splitting is worse than testing every primitive in the node.
+	if(best_axis < 0 || best_cost >= surfaceArea(node_bounds) * leaf_cost(n)) {
+		return;
+	}
+
+	const auto it_mid = std::partition(
+		order.begin() + begin, order.begin() + end,
+		[&](int index) {
+			return get_bin(index, best_axis) < best_split;
+		});
+	const int mid = it_mid - order.begin();
+
+	const int child_index = nodes.size();
+	nodes.emplace_back();
+	nodes.emplace_back();
+	nodes[node_index].first = child_index;
+	nodes[node_index].count = 0;
+
+	buildTreeNode(bounds, leaf_width, nodes, order, child_index, begin, mid, depth + 1);
+	buildTreeNode(bounds, leaf_width, nodes, order, child_index + 1, mid, end, depth + 1);
+}
+
+// Build tree over primitives with binned SAH. Leaves refer to order[first, first + count),
+// where order is a permutation of primitive indices.
+// leaf_width: # of primitives that can be tested at once (e.g. by SIMD).
+void buildTree(const std::vector<Eigen::AlignedBox3f>& bounds, int leaf_width,
+	std::vector<BVHNode>& nodes, std::vector<int>& order) {
+	nodes.clear();
+	order.resize(bounds.size());
+	for(int i = 0; i < bounds.size(); i++) {
+		order[i] = i;
+	}
+	if(bounds.empty()) {
+		return;
+	}
+
+	nodes.reserve(2 * bounds.size() / leaf_width + 1);
+	nodes.emplace_back();
+	buildTreeNode(bounds, leaf_width, nodes, order, 0, 0, bounds.size(), 0);
+}
+
+// Call visit_leaf(node) for each leaf hit by ray, roughly near to far.
+// visit_leaf can shrink t_max to cull farther nodes, or return true to stop.
+template<class LeafFn>
+void traverse(const std::vector<BVHNode>& nodes,
+	const Eigen::Vector3f& org, const Eigen::Vector3f& dir_inv, const float& t_max,
+	LeafFn visit_leaf) {
+
+	if(nodes.empty() || intersectBox(nodes[0].bounds, org, dir_inv, t_max) == inf) {
+		return;
+	}
+
+	std::array<int, max_depth + 2> stack;
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while(stack_size > 0) {
+		const BVHNode& node = nodes[stack[--stack_size]];
+
+		if(node.count > 0) {
+			if(visit_leaf(node)) {
+				return;
+			}
+			continue;
+		}
+
+		// Visit nearer child first, so that farther one is likely to be culled.
+		const float t0 = intersectBox(nodes[node.first].bounds, org, dir_inv, t_max);
+		const float t1 = intersectBox(nodes[node.first + 1].bounds, org, dir_inv, t_max);
+		if(t0 <= t1) {
+			if(t1 < inf) {
+				stack[stack_size++] = node.first + 1;
+			}
+			if(t0 < inf) {
+				stack[stack_size++] = node.first;
+			}
+		} else {
+			if(t0 < inf) {
+				stack[stack_size++] = node.first;
+			}
+			if(t1 < inf) {
+				stack[stack_size++] = node.first + 1;
+			}
+		}
+	}
+}
+
+// Same as traverse, but visits leaves hit by any ray in packet.
+// hits[i].t is used as t_max of i-th ray.
+template<class LeafFn>
+void traversePacket(const std::vector<BVHNode>& nodes,
+	const RayPacket& packet, const Hit* hits, LeafFn visit_leaf) {
+
+	std::array<Eigen::Vector3f, simd_width> orgs;
+	std::array<Eigen::Vector3f, simd_width> dir_invs;
+	for(int i = 0; i < packet.size; i++) {
+		orgs[i] = Eigen::Vector3f(packet.org_x[i], packet.org_y[i], packet.org_z[i]);
+		dir_invs[i] = Eigen::Vector3f(
+			packet.dir_x[i], packet.dir_y[i], packet.dir_z[i]).cwiseInverse();
+	}
+
+	// Return nearest entry t among rays, or infinity when all rays miss.
+	auto intersect_box_any = [&](const Eigen::AlignedBox3f& box) {
+		float t_min = inf;
+		for(int i = 0; i < packet.size; i++) {
+			t_min = std::min(t_min, intersectBox(box, orgs[i], dir_invs[i], hits[i].t));
+		}
+		return t_min;
+	};
+
+	if(nodes.empty() || intersect_box_any(nodes[0].bounds) == inf) {
+		return;
+	}
+
+	std::array<int, max_depth + 2> stack;
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while(stack_size > 0) {
+		const BVHNode& node = nodes[stack[--stack_size]];
+
+		if(node.count > 0) {
+			visit_leaf(node);
+			continue;
+		}
+
+		const float t0 = intersect_box_any(nodes[node.first].bounds);
+		const float t1 = intersect_box_any(nodes[node.first + 1].bounds);
+		if(t0 <= t1) {
+			if(t1 < inf) {
+				stack[stack_size++] = node.first + 1;
+			}
+			if(t0 < inf) {
+				stack[stack_size++] = node.first;
+			}
+		} else {
+			if(t0 < inf) {
+				stack[stack_size++] = node.first;
+			}
+			if(t1 < inf) {
+				stack[stack_size++] = node.first + 1;
+			}
+		}
+	}
+}
+
+
+BVH::BVH() {
+}
+
+void BVH::build(const std::vector<Triangle>& tris) {
+	build(tris, 0, tris.size());
+}
+
+void BVH::build(const std::vector<Triangle>& tris, int first, int count) {
+	assert(0 <= first && first + count <= tris.size());
+
+	std::vector<Eigen::AlignedBox3f> tri_bounds;
+	tri_bounds.reserve(count);
+	for(int i = first; i < first + count; i++) {
+		tri_bounds.push_back(getTriangleBounds(tris[i]));
+	}
+
+	std::vector<int> order;
+	buildTree(tri_bounds, simd_width, nodes, order);
+
+	// Pack triangles of each leaf into blocks, and make the leaf point to them.
+	blocks.clear();
+	for(auto& node : nodes) {
+		if(node.count == 0) {
+			continue;
+		}
+
+		const int first_block = blocks.size();
+		for(int i = 0; i < node.count; i++) {
+			if(i % simd_width == 0) {
+				blocks.emplace_back();
+			}
+			const int index = first + order[node.first + i];
+			blocks.back().set(i % simd_width, tris[index], index);
+		}
+		node.first = first_block;
+		node.count = blocks.size() - first_block;
+	}
+}
+
+void BVH::refit(const std::vector<Triangle>& tris) {
+	for(int i = nodes.size() - 1; i >= 0; i--) {
+		auto& node = nodes[i];
+		node.bounds.setEmpty();
+		if(node.count > 0) {
+			for(int j = node.first; j < node.first + node.count; j++) {
+				auto& block = blocks[j];
+				for(int slot = 0; slot < simd_width; slot++) {
+					const int index = block.index[slot];
+					if(index < 0) {
+						continue;
+					}
+					assert(index < tris.size());
+					block.set(slot, tris[index], index);
+					node.bounds.extend(getTriangleBounds(tris[index]));
+				}
+			}
+		} else {
+			node.bounds.extend(nodes[node.first].bounds);
+			node.bounds.extend(nodes[node.first + 1].bounds);
+		}
+	}
+}
+
+Eigen::AlignedBox3f BVH::getBounds() const {
+	return nodes.empty() ? Eigen::AlignedBox3f() : nodes[0].bounds;
+}
+
+boost::optional<Intersection> BVH::intersect(const std::vector<Triangle>& tris, Ray ray) const {
+	const Hit hit = closestHit(ray);
+	if(hit.index < 0) {
+		return boost::optional<Intersection>();
+	}
+	return boost::optional<Intersection>(tris[hit.index].createIntersection(ray, hit));
+}
+
+Hit BVH::closestHit(const Ray& ray) const {
+	Hit hit;
+	intersect(ray, ray.dir.cwiseInverse(), hit);
+	return hit;
+}
+
+bool BVH::occluded(const Ray& ray, float t_max) const {
+	return occluded(ray, ray.dir.cwiseInverse(), t_max);
+}
+
+bool BVH::occluded(const Ray& ray, const Eigen::Vector3f& dir_inv, float t_max) const {
+	Hit hit;
+	hit.t = t_max;
+	bool found = false;
+	traverse(nodes, ray.org, dir_inv, hit.t, [&](const BVHNode& leaf) {
+		for(int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			if(blocks[i].intersect(ray, hit)) {
+				found = true;
+				return true;
+			}
+		}
+		return false;
+	});
+	return found;
+}
+
+void BVH::intersect(const Ray& ray, const Eigen::Vector3f& dir_inv, Hit& hit) const {
+	traverse(nodes, ray.org, dir_inv, hit.t, [&](const BVHNode& leaf) {
+		for(int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			blocks[i].intersect(ray, hit);
+		}
+		return false;
+	});
+}
+
+void BVH::intersect(const RayPacket& packet, Hit* hits) const {
+	traversePacket(nodes, packet, hits, [&](const BVHNode& leaf) {
+		for(int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			blocks[i].intersect(packet, hits);
+		}
+	});
+}
+
+
+TwoLevelBVH::TwoLevelBVH() {
+}
+
+void TwoLevelBVH::setObject(ObjectId id,
+	const std::vector<Triangle>& tris, int first, int count) {
+	auto bvh = std::make_shared<BVH>();
+	bvh->build(tris, first, count);
+	objects[id] = bvh;
+}
+
+void TwoLevelBVH::removeObject(ObjectId id) {
+	objects.erase(id);
+}
+
+void TwoLevelBVH::buildTop() {
+	top_objects.clear();
+	std::vector<Eigen::AlignedBox3f> bounds;
+	for(const auto& pair : objects) {
+		if(pair.second->getBounds().isEmpty()) {
+			continue;
+		}
+		top_objects.push_back(pair.second);
+		bounds.push_back(pair.second->getBounds());
+	}
+
+	std::vector<int> order;
+	buildTree(bounds, 1, top_nodes, order);
+
+	// Reorder objects so that leaves can point to them directly.
+	std::vector<std::shared_ptr<const BVH>> objects_ordered;
+	objects_ordered.reserve(order.size());
+	for(int index : order) {
+		objects_ordered.push_back(top_objects[index]);
+	}
+	top_objects.swap(objects_ordered);
+}
+
+boost::optional<Intersection> TwoLevelBVH::intersect(
+	const std::vector<Triangle>& tris, Ray ray) const {
+	const Hit hit = closestHit(ray);
+	if(hit.index < 0) {
+		return boost::optional<Intersection>();
+	}
+	return boost::optional<Intersection>(tris[hit.index].createIntersection(ray, hit));
+}
+
+Hit TwoLevelBVH::closestHit(const Ray& ray) const {
+	Hit hit;
+	intersect(ray, ray.dir.cwiseInverse(), hit);
+	return hit;
+}
+
+bool TwoLevelBVH::occluded(const Ray& ray, float t_max) const {
+	const Eigen::Vector3f dir_inv = ray.dir.cwiseInverse();
+	bool found = false;
+	traverse(top_nodes, ray.org, dir_inv, t_max, [&](const BVHNode& leaf) {
+		for(int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			if(top_objects[i]->occluded(ray, dir_inv, t_max)) {
+				found = true;
+				return true;
+			}
+		}
+		return false;
+	});
+	return found;
+}
+
+void TwoLevelBVH::intersect(const Ray& ray, const Eigen::Vector3f& dir_inv, Hit& hit) const {
+	traverse(top_nodes, ray.org, dir_inv, hit.t, [&](const BVHNode& leaf) {
+		for(int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			top_objects[i]->intersect(ray, dir_inv, hit);
+		}
+		return false;
+	});
+}
+
+void TwoLevelBVH::intersect(const RayPacket& packet, Hit* hits) const {
+	traversePacket(top_nodes, packet, hits, [&](const BVHNode& leaf) {
+		for(int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			top_objects[i]->intersect(packet, hits);
+		}
+	});
+}
+
+}  // namespace
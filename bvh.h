@@ -0,0 +1,112 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <eigen3/Eigen/Dense>
+#include <eigen3/Eigen/Geometry>
+
+#include "light.h"
+
+namespace construct {
+
+// Leaf: count > 0, [first, first + count) are primitives (what they are depends on the tree).
+// Interior: count == 0, children are nodes[first] and nodes[first + 1].
+//
+// Children are always stored after their parent.
+class BVHNode {
+public:
+	Eigen::AlignedBox3f bounds;
+	int first;
+	int count;
+};
+
+
+// Bounding volume hierarchy over a triangle soup.
+//
+// BVH doesn't own triangles. It only stores indices into the vector passed
+// to build(), so the same vector (same order & size) must be passed to
+// refit() and intersect().
+//
+// build() uses binned SAH, which is slow-ish but gives good trees for
+// static geometry. refit() only recalculates bounds and keeps topology, which
+// is cheap and good enough when triangles move slightly (e.g. UI).
+//
+// Leaves hold copies of triangle geometry in TriangleBlocks, so after
+// triangles are moved, refit() is needed before intersect().
+class BVH {
+public:
+	BVH();
+
+	void build(const std::vector<Triangle>& tris);
+
+	// Build over tris[first, first + count) only.
+	void build(const std::vector<Triangle>& tris, int first, int count);
+
+	void refit(const std::vector<Triangle>& tris);
+
+	Eigen::AlignedBox3f getBounds() const;
+
+	// Return nearest intersection, same as trying every triangle.
+	// Same as closestHit + Triangle::createIntersection.
+	boost::optional<Intersection> intersect(const std::vector<Triangle>& tris, Ray ray) const;
+
+	// Return nearest hit (index < 0 when nothing was hit). Shading
+	// attributes are left to Triangle::createIntersection of the winner.
+	Hit closestHit(const Ray& ray) const;
+
+	// Return true when any triangle is hit before t_max (e.g. shadow rays).
+	// Stops at the first hit found, so cheaper than closestHit.
+	bool occluded(const Ray& ray, float t_max) const;
+	// dir_inv: cwiseInverse of ray.dir
+	bool occluded(const Ray& ray, const Eigen::Vector3f& dir_inv, float t_max) const;
+
+	// Update hit when a triangle nearer than hit.t is found.
+	// dir_inv: cwiseInverse of ray.dir
+	void intersect(const Ray& ray, const Eigen::Vector3f& dir_inv, Hit& hit) const;
+
+	// Find nearest hit for each ray in packet. hits[i] corresponds to i-th ray,
+	// and must be initialized (with default Hit, or t limit).
+	void intersect(const RayPacket& packet, Hit* hits) const;
+private:
+	std::vector<BVHNode> nodes;
+	std::vector<TriangleBlock> blocks;
+};
+
+
+// Two-level BVH for geometry made of many small objects (e.g. cuboids).
+//
+// Each object has its own BVH over its range of triangles, and the top-level
+// BVH contains objects. Changing an object only rebuilds its own BVH and
+// the top-level BVH (which is small, O(# of objects)).
+//
+// Copying is cheap, since per-object BVHs are shared.
+class TwoLevelBVH {
+public:
+	TwoLevelBVH();
+
+	// Add or replace an object, which consists of tris[first, first + count).
+	void setObject(ObjectId id, const std::vector<Triangle>& tris, int first, int count);
+	void removeObject(ObjectId id);
+
+	// Rebuild the top-level BVH. Must be called after setObject / removeObject
+	// before intersect.
+	void buildTop();
+
+	// Same as BVH.
+	boost::optional<Intersection> intersect(const std::vector<Triangle>& tris, Ray ray) const;
+	Hit closestHit(const Ray& ray) const;
+	bool occluded(const Ray& ray, float t_max) const;
+	void intersect(const Ray& ray, const Eigen::Vector3f& dir_inv, Hit& hit) const;
+	void intersect(const RayPacket& packet, Hit* hits) const;
+private:
+	std::map<ObjectId, std::shared_ptr<const BVH>> objects;
+
+	// Top-level tree. Leaves point to top_objects.
+	std::vector<BVHNode> top_nodes;
+	std::vector<std::shared_ptr<const BVH>> top_objects;
+};
+
+}  // namespace
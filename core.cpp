@@ -9,6 +9,7 @@
 #include <random>
 
 #include <json/json.h>
+#include <sys/stat.h>
 #include <v8.h>
 
 #include "sky.h"
@@ -17,6 +18,9 @@
 
 namespace construct {
 
+// Loaded at startup & saved at exit.
+const std::string irradiance_bake_path = "cache/irradiance.bin";
+
 Eigen::Vector3f ovrToEigen(OVR::Vector3f v) {
 	return Eigen::Vector3f(v.x, v.y, v.z);
 }
@@ -62,7 +66,7 @@ Core::Core(bool windowed) :
 	scene.reset(new Scene());
 
 	addInitialObjects();
-	scene->updateGeometry();
+	scene->loadIrradiance(irradiance_bake_path);
 }
 
 void Core::addInitialObjects() {
@@ -150,7 +154,8 @@ float Core::estimateMaxRadiance() {
 	const auto view_r = getViewRight();
 	const auto view_u = getViewUp();
 
-	std::vector<float> radiances;
+	// Rays in a grid are coherent, so trace them in packets.
+	std::vector<Ray> rays;
 	for(int i = -5; i < 6; i++) {
 		for (int j = -5; j < 6; j++) {
 			Eigen::Vector3f sample_dir =
@@ -159,10 +164,14 @@ float Core::estimateMaxRadiance() {
 				view_r * j / 8.0;
 			sample_dir.normalize();
 
-			radiances.push_back(
-				scene->getRadiance(Ray(eye_pos, sample_dir)).norm());
+			rays.emplace_back(eye_pos, sample_dir);
 		}
 	}
+
+	std::vector<float> radiances;
+	for(const auto& radiance : scene->getRadiance(rays)) {
+		radiances.push_back(radiance.norm());
+	}
 	std::sort(radiances.begin(), radiances.end());
 
 	const int ix_b = static_cast<int>(radiances.size() * 0.75);
@@ -264,40 +273,43 @@ void Core::addBuilding() {
 void Core::attachCuboid(Object& object,
 	Eigen::Vector3f size, Eigen::Vector3f pos, Eigen::Vector3f color) {
 
-	Eigen::Matrix<float, 6 * 6, 3 + 3, Eigen::RowMajor> vertex;
-	for(int i = 0; i < 3; i++) {
-		Eigen::Vector3f d(0, 0, 0);
-		Eigen::Vector3f e0(0, 0, 0);
-		Eigen::Vector3f e1(0, 0, 0);
+	// Every cuboid is an instance of the same unit cube.
+	if(!cuboid) {
+		Eigen::Matrix<float, 6 * 6, 3, Eigen::RowMajor> vertex;
+		for(int i = 0; i < 3; i++) {
+			Eigen::Vector3f d(0, 0, 0);
+			Eigen::Vector3f e0(0, 0, 0);
+			Eigen::Vector3f e1(0, 0, 0);
 
-		d[i] = 0.5;
-		e0[(i + 1) % 3] = 0.5;
-		e1[(i + 2) % 3] = 0.5;
+			d[i] = 0.5;
+			e0[(i + 1) % 3] = 0.5;
+			e1[(i + 2) % 3] = 0.5;
 
-		for(int side = 0; side < 2; side++) {
-			const int face_offset = 6 * (i * 2 + side);
+			for(int side = 0; side < 2; side++) {
+				const int face_offset = 6 * (i * 2 + side);
 
-			vertex.row(face_offset + 0).head(3) = d - e0 - e1;
-			vertex.row(face_offset + 1).head(3) = d + e0 - e1;
-			vertex.row(face_offset + 2).head(3) = d - e0 + e1;
+				vertex.row(face_offset + 0) = d - e0 - e1;
+				vertex.row(face_offset + 1) = d + e0 - e1;
+				vertex.row(face_offset + 2) = d - e0 + e1;
 
-			vertex.row(face_offset + 3).head(3) = d + e0 + e1;
-			vertex.row(face_offset + 4).head(3) = d - e0 + e1;
-			vertex.row(face_offset + 5).head(3) = d + e0 - e1;
+				vertex.row(face_offset + 3) = d + e0 + e1;
+				vertex.row(face_offset + 4) = d - e0 + e1;
+				vertex.row(face_offset + 5) = d + e0 - e1;
 
-			d *= -1;
-			e0 *= -1;
+				d *= -1;
+				e0 *= -1;
+			}
 		}
+		cuboid = Geometry::createPos(vertex.rows(), vertex.data());
 	}
 
-	for(int i = 0; i < 36; i++) {
-		Eigen::Vector3f pre_v = vertex.row(i).head(3);
-		vertex.row(i).head(3) = pre_v.cwiseProduct(size) + pos;
-		vertex.row(i).tail(3) = color;
-	}
+	Instance instance;
+	instance.local_to_world = Eigen::Translation3f(pos) * Eigen::Scaling(size);
+	instance.reflectance = color;
 
 	object.type = ObjectType::STATIC;
-	object.geometry = Geometry::createPosColor(vertex.rows(), vertex.data());
+	object.geometry = cuboid;
+	object.instance = instance;
 }
 
 
@@ -685,13 +697,9 @@ void Core::render() {
 	const int width = use_distortion ? buffer_width : screen_width;
 	const int height = use_distortion ? buffer_height : screen_height;
 
-	// Left eye
-	glViewport(0, 0, width / 2, height);
-	scene->render(&projections.first.M[0][0]);
-
-	// Right eye
-	glViewport(width / 2, 0, width / 2, height);
-	scene->render(&projections.second.M[0][0]);
+	// Both eyes at once
+	glViewport(0, 0, width, height);
+	scene->render(&projections.first.M[0][0], &projections.second.M[0][0]);
 
 	// Apply warp shader (framebuffer -> back buffer)
 	if(use_distortion) {
@@ -757,7 +765,9 @@ void Core::run() {
 
 			glfwPollEvents();
 		}
-		
+
+		mkdir("cache", 0755);
+		scene->saveIrradiance(irradiance_bake_path);
 	} catch(char* exc) {
 		std::cout << "Exception: " << exc << std::endl;
 	} catch(std::string exc) {
@@ -108,6 +108,9 @@ private:
 	std::shared_ptr<Geometry> proxy;
 	std::shared_ptr<Texture> pre_buffer;
 
+	// Unit cube shared by objects of attachCuboid.
+	std::shared_ptr<Geometry> cuboid;
+
 	double t_last_update;
 };
 
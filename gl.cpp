@@ -89,11 +89,15 @@ void Shader::setUniform(std::string variable, float v0, float v1, float v2, floa
 	glUniform4f(getVariable(variable), v0, v1, v2, v3);
 }
 
-void Shader::setUniformMat4(std::string variable, const float* pv) {
-	glUniformMatrix4fv(getVariable(variable), 1, GL_TRUE, pv);
+void Shader::setUniformMat4(std::string variable, const float* pv, int count) {
+	glUniformMatrix4fv(getVariable(variable), count, GL_TRUE, pv);
 }
 
 
+GLuint Shader::unsafeGetId() const {
+	return program;
+}
+
 void Shader::use() {
 	glUseProgram(program);
 }
@@ -103,7 +107,7 @@ std::shared_ptr<Texture> Texture::create(int width, int height, bool hdr) {
 	return std::shared_ptr<Texture>(new Texture(width, height, hdr));
 }
 
-GLuint Texture::unsafeGetId() {
+GLuint Texture::unsafeGetId() const {
 	return id;
 }
 
@@ -135,6 +139,103 @@ void Texture::useIn(int n) {
 }
 
 
+std::shared_ptr<TextureBuffer> TextureBuffer::create() {
+	return std::shared_ptr<TextureBuffer>(new TextureBuffer());
+}
+
+TextureBuffer::TextureBuffer() {
+	glGenBuffers(1, &buffer);
+	glGenTextures(1, &texture);
+
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA16F, buffer);
+}
+
+TextureBuffer::~TextureBuffer() {
+	glDeleteTextures(1, &texture);
+	glDeleteBuffers(1, &buffer);
+}
+
+void TextureBuffer::setData(const std::vector<uint16_t>& data) {
+	assert(data.size() % 4 == 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER,
+		sizeof(uint16_t) * data.size(), data.data(), GL_DYNAMIC_DRAW);
+}
+
+void TextureBuffer::updateData(int first, int count, const uint16_t* data) {
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferSubData(GL_TEXTURE_BUFFER,
+		sizeof(uint16_t) * 4 * first, sizeof(uint16_t) * 4 * count, data);
+}
+
+void TextureBuffer::useIn(int n) {
+	glActiveTexture(GL_TEXTURE0 + n);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+}
+
+
+std::shared_ptr<InstanceArray> InstanceArray::create(std::vector<int> attributes) {
+	return std::shared_ptr<InstanceArray>(new InstanceArray(attributes));
+}
+
+InstanceArray::InstanceArray(std::vector<int> attributes) :
+	attributes(attributes) {
+	glGenBuffers(1, &buffer);
+}
+
+InstanceArray::~InstanceArray() {
+	glDeleteBuffers(1, &buffer);
+}
+
+int InstanceArray::getColumns() {
+	return std::accumulate(attributes.begin(), attributes.end(), 0);
+}
+
+int InstanceArray::size() {
+	return raw_data.size() / getColumns();
+}
+
+std::vector<float>& InstanceArray::getData() {
+	return raw_data;
+}
+
+void InstanceArray::notifyDataChange() {
+	assert(raw_data.size() % getColumns() == 0);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER,
+		sizeof(float) * raw_data.size(), raw_data.data(), GL_DYNAMIC_DRAW);
+}
+
+void InstanceArray::bind(int location, int divisor) {
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	const int columns = getColumns();
+	int current_offset = 0;
+	for(int i_attrib = 0; i_attrib < attributes.size(); i_attrib++) {
+		glEnableVertexAttribArray(location + i_attrib);
+		glVertexAttribPointer(
+			location + i_attrib,
+			attributes[i_attrib],
+			GL_FLOAT,
+			GL_FALSE,
+			sizeof(float) * columns,
+			(void*)(sizeof(float) * current_offset));
+		glVertexAttribDivisor(location + i_attrib, divisor);
+		current_offset += attributes[i_attrib];
+	}
+}
+
+void InstanceArray::unbind(int location) {
+	// Divisors are kept in vertex array; reset them for Geometry::render.
+	for(int i_attrib = 0; i_attrib < attributes.size(); i_attrib++) {
+		glVertexAttribDivisor(location + i_attrib, 0);
+		glDisableVertexAttribArray(location + i_attrib);
+	}
+}
+
+
 std::shared_ptr<Geometry> Geometry::createPos(int n_vertex, const float* pos) {
 	return std::shared_ptr<Geometry>(new Geometry(
 		n_vertex,
@@ -197,7 +298,41 @@ void Geometry::notifyDataChange() {
 	sendToGPU();
 }
 
-void Geometry::render() {
+void Geometry::notifyDataChange(int first, int count) {
+	assert(0 <= first && first + count <= n_vertex);
+	const int columns = getColumns();
+
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	glBufferSubData(GL_ARRAY_BUFFER,
+		sizeof(float) * columns * first, sizeof(float) * columns * count,
+		raw_data.data() + columns * first);
+}
+
+void Geometry::render(int n_copies) {
+	bindAttributes();
+	if(n_copies == 1) {
+		glDrawArrays(GL_TRIANGLES, 0, n_vertex);
+	} else {
+		glDrawArraysInstanced(GL_TRIANGLES, 0, n_vertex, n_copies);
+	}
+
+	for(int i_attrib = 0; i_attrib < attributes.size(); i_attrib++) {
+		glDisableVertexAttribArray(i_attrib);
+	}
+}
+
+void Geometry::renderInstanced(InstanceArray& instances, int n_copies) {
+	bindAttributes();
+	instances.bind(attributes.size(), n_copies);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, n_vertex, instances.size() * n_copies);
+	instances.unbind(attributes.size());
+
+	for(int i_attrib = 0; i_attrib < attributes.size(); i_attrib++) {
+		glDisableVertexAttribArray(i_attrib);
+	}
+}
+
+void Geometry::bindAttributes() {
 	glBindVertexArray(vertex_array);
 	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
 
@@ -214,12 +349,6 @@ void Geometry::render() {
 			(void*)(sizeof(float) * current_offset));
 		current_offset += attributes[i_attrib];
 	}
-	
-	glDrawArrays(GL_TRIANGLES, 0, n_vertex);
-
-	for(int i_attrib; i_attrib < attributes.size(); i_attrib++) {
-		glDisableVertexAttribArray(i_attrib);
-	}
 }
 
 }  // namespace
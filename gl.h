@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <string>
@@ -18,8 +19,10 @@ public:
 	void setUniform(std::string variable, float v0);
 	void setUniform(std::string variable, float v0, float v1);
 	void setUniform(std::string variable, float v0, float v1, float v2, float v3);
-	void setUniformMat4(std::string variable, const float* pv);
+	// count: # of matrices, for arrays.
+	void setUniformMat4(std::string variable, const float* pv, int count = 1);
 
+	GLuint unsafeGetId() const;
 	void use();
 protected:
 	Shader(const std::string vertex_file_path, const std::string fragment_file_path);
@@ -36,7 +39,7 @@ class Texture {
 public:
 	~Texture();
 	static std::shared_ptr<Texture> create(int width, int height, bool hdr = false);
-	GLuint unsafeGetId();
+	GLuint unsafeGetId() const;
 
 	// n: texture slot index
 	void useIn(int n = 0);
@@ -47,6 +50,58 @@ private:
 };
 
 
+// 1D array of RGBA16F texels in a buffer object, read in shaders as
+// samplerBuffer (texelFetch). Good for large data updated in small parts.
+class TextureBuffer {
+public:
+	static std::shared_ptr<TextureBuffer> create();
+	~TextureBuffer();
+
+	// Replace whole content. data: 4 halfs (RGBA) per texel.
+	void setData(const std::vector<uint16_t>& data);
+
+	// Overwrite texels [first, first + count). Size doesn't change.
+	void updateData(int first, int count, const uint16_t* data);
+
+	// n: texture slot index
+	void useIn(int n = 0);
+private:
+	TextureBuffer();
+private:
+	GLuint buffer;
+	GLuint texture;
+};
+
+
+// Per-instance attributes for Geometry::renderInstanced. Same tabular layout
+// as Geometry, but each row is used by a whole instance instead of a vertex.
+class InstanceArray {
+public:
+	// attributes: # of columns of each attribute.
+	static std::shared_ptr<InstanceArray> create(std::vector<int> attributes);
+	~InstanceArray();
+
+	// # of instances (rows).
+	int size();
+
+	std::vector<float>& getData();
+	void notifyDataChange();
+
+	// Enable attributes at location, location + 1, ... for drawing.
+	// divisor: # of consecutive draw instances sharing a row.
+	void bind(int location, int divisor = 1);
+	void unbind(int location);
+protected:
+	InstanceArray(std::vector<int> attributes);
+	int getColumns();
+private:
+	GLuint buffer;
+
+	std::vector<int> attributes;
+	std::vector<float> raw_data;
+};
+
+
 // Purpose of vertex array is unclear to me. keep it as is (or add helpful comment).
 // Vertex buffer is tabular data, with columns = posx, posy, posz, u, v, for example.
 //
@@ -58,15 +113,24 @@ public:
 	static std::shared_ptr<Geometry> createPosUV(int n_vertex, const float* pos_uv);
 	~Geometry();
 
-	void render();
+	// Draw n_copies times at once (told apart by gl_InstanceID).
+	void render(int n_copies = 1);
+
+	// Draw instances.size() * n_copies copies at once. Attributes of
+	// instances follow those of this geometry; n_copies consecutive
+	// gl_InstanceIDs get the same instance.
+	void renderInstanced(InstanceArray& instances, int n_copies = 1);
 
 	std::vector<float>& getData();
 	void notifyDataChange();
+	// Same as above, when only vertices [first, first + count) changed.
+	void notifyDataChange(int first, int count);
 protected:
 	Geometry(int n_vertex, std::vector<int> attributes, const float* data);
 	int getColumns();
 
 	void sendToGPU();
+	void bindAttributes();
 private:
 	const int n_vertex;
 	GLuint vertex_array;
@@ -1,10 +1,23 @@
 #version 330 core
-uniform mat4 world_to_screen;  // projection * view
+uniform mat4 world_to_screen[2];  // projection * view of left & right eye
+uniform mat4 local_to_world;
+uniform samplerBuffer irradiance;  // RGB of each vertex (see Scene::irradiance_buffer)
+uniform int irradiance_offset;  // texel of vertex 0 of this geometry
 layout(location = 0) in vec3 vertexPosition_modelspace;
-layout(location = 1) in vec3 vertexColor;
+out float gl_ClipDistance[1];
 out vec3 co;
 
 void main(){
-	gl_Position = world_to_screen * vec4(vertexPosition_modelspace, 1);
-	co = vertexColor;
+	vec4 pos_world = local_to_world * vec4(vertexPosition_modelspace, 1);
+	// Stereo: both eyes are drawn by one instanced call. Parity of
+	// gl_InstanceID picks the eye; even instances are squeezed into the left
+	// half of the viewport, odd ones into the right half.
+	// gl_ClipDistance[0] is the distance to the middle, so that nothing
+	// leaks into the other eye's half.
+	// instance.vs and tex.vs have the same 4 lines below; keep them identical.
+	int eye = gl_InstanceID % 2;
+	vec4 pos_screen = world_to_screen[eye] * pos_world;
+	gl_Position = vec4(pos_screen.x * 0.5 + (eye == 0 ? -0.5 : 0.5) * pos_screen.w, pos_screen.yzw);
+	gl_ClipDistance[0] = pos_screen.w + (eye == 0 ? -pos_screen.x : pos_screen.x);
+	co = texelFetch(irradiance, irradiance_offset + gl_VertexID).rgb;
 }
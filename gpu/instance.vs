@@ -0,0 +1,22 @@
+#version 330 core
+uniform mat4 world_to_screen[2];  // projection * view of left & right eye
+uniform samplerBuffer irradiance;  // RGB of each vertex (see Scene::irradiance_buffer)
+layout(location = 0) in vec3 vertexPosition_modelspace;
+// per instance (see Scene::instance_batches)
+layout(location = 1) in vec4 local_to_world0;  // rows of affine transform
+layout(location = 2) in vec4 local_to_world1;
+layout(location = 3) in vec4 local_to_world2;
+layout(location = 4) in float irradiance_offset;  // texel of vertex 0 of this instance
+out float gl_ClipDistance[1];
+out vec3 co;
+
+void main(){
+	vec4 pos = vec4(vertexPosition_modelspace, 1);
+	vec4 pos_world = vec4(dot(local_to_world0, pos), dot(local_to_world1, pos), dot(local_to_world2, pos), 1);
+	// Stereo; see base.vs.
+	int eye = gl_InstanceID % 2;
+	vec4 pos_screen = world_to_screen[eye] * pos_world;
+	gl_Position = vec4(pos_screen.x * 0.5 + (eye == 0 ? -0.5 : 0.5) * pos_screen.w, pos_screen.yzw);
+	gl_ClipDistance[0] = pos_screen.w + (eye == 0 ? -pos_screen.x : pos_screen.x);
+	co = texelFetch(irradiance, int(irradiance_offset) + gl_VertexID).rgb;
+}
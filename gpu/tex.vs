@@ -1,11 +1,17 @@
 #version 330 core
-uniform mat4 world_to_screen;  // projection * view
+uniform mat4 world_to_screen[2];  // projection * view of left & right eye
 uniform mat4 local_to_world;
-layout(location = 0) in vec3 pos_world;
+layout(location = 0) in vec3 vertexPosition_modelspace;
 layout(location = 1) in vec2 uv_tex;
+out float gl_ClipDistance[1];
 out vec2 uv;
 
 void main(){
-	gl_Position = world_to_screen * (local_to_world * vec4(pos_world, 1));
+	vec4 pos_world = local_to_world * vec4(vertexPosition_modelspace, 1);
+	// Stereo; see base.vs.
+	int eye = gl_InstanceID % 2;
+	vec4 pos_screen = world_to_screen[eye] * pos_world;
+	gl_Position = vec4(pos_screen.x * 0.5 + (eye == 0 ? -0.5 : 0.5) * pos_screen.w, pos_screen.yzw);
+	gl_ClipDistance[0] = pos_screen.w + (eye == 0 ? -pos_screen.x : pos_screen.x);
 	uv = uv_tex;
 }
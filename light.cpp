@@ -1,7 +1,103 @@
 #include "light.h"
 
+#include <cstring>
+#include <limits>
+
+#include <immintrin.h>
+
 namespace construct {
 
+// Thin wrappers of SSE / AVX intrinsics, so that the kernels below
+// can be written once for both widths.
+#ifdef __AVX__
+typedef __m256 vfloat;
+
+inline vfloat vset1(float x) { return _mm256_set1_ps(x); }
+inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+inline void vstore(float* p, vfloat x) { _mm256_storeu_ps(p, x); }
+inline vfloat vadd(vfloat x, vfloat y) { return _mm256_add_ps(x, y); }
+inline vfloat vsub(vfloat x, vfloat y) { return _mm256_sub_ps(x, y); }
+inline vfloat vmul(vfloat x, vfloat y) { return _mm256_mul_ps(x, y); }
+inline vfloat vdiv(vfloat x, vfloat y) { return _mm256_div_ps(x, y); }
+inline vfloat vand(vfloat x, vfloat y) { return _mm256_and_ps(x, y); }
+inline vfloat vgt(vfloat x, vfloat y) { return _mm256_cmp_ps(x, y, _CMP_GT_OQ); }
+inline vfloat vge(vfloat x, vfloat y) { return _mm256_cmp_ps(x, y, _CMP_GE_OQ); }
+inline vfloat vle(vfloat x, vfloat y) { return _mm256_cmp_ps(x, y, _CMP_LE_OQ); }
+inline vfloat vlt(vfloat x, vfloat y) { return _mm256_cmp_ps(x, y, _CMP_LT_OQ); }
+inline int vmask(vfloat x) { return _mm256_movemask_ps(x); }
+#else
+typedef __m128 vfloat;
+
+inline vfloat vset1(float x) { return _mm_set1_ps(x); }
+inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+inline void vstore(float* p, vfloat x) { _mm_storeu_ps(p, x); }
+inline vfloat vadd(vfloat x, vfloat y) { return _mm_add_ps(x, y); }
+inline vfloat vsub(vfloat x, vfloat y) { return _mm_sub_ps(x, y); }
+inline vfloat vmul(vfloat x, vfloat y) { return _mm_mul_ps(x, y); }
+inline vfloat vdiv(vfloat x, vfloat y) { return _mm_div_ps(x, y); }
+inline vfloat vand(vfloat x, vfloat y) { return _mm_and_ps(x, y); }
+inline vfloat vgt(vfloat x, vfloat y) { return _mm_cmpgt_ps(x, y); }
+inline vfloat vge(vfloat x, vfloat y) { return _mm_cmpge_ps(x, y); }
+inline vfloat vle(vfloat x, vfloat y) { return _mm_cmple_ps(x, y); }
+inline vfloat vlt(vfloat x, vfloat y) { return _mm_cmplt_ps(x, y); }
+inline int vmask(vfloat x) { return _mm_movemask_ps(x); }
+#endif
+
+inline vfloat vdot(vfloat x0, vfloat y0, vfloat z0, vfloat x1, vfloat y1, vfloat z1) {
+	return vadd(vadd(vmul(x0, x1), vmul(y0, y1)), vmul(z0, z1));
+}
+
+// Same algorithm as Triangle::intersect. Inputs are SoA vectors.
+// Returns lane mask of valid hits nearer than t_max, and writes t, a, b.
+inline int intersectLanes(
+	vfloat org_x, vfloat org_y, vfloat org_z,
+	vfloat dir_x, vfloat dir_y, vfloat dir_z,
+	vfloat p0_x, vfloat p0_y, vfloat p0_z,
+	vfloat d1_x, vfloat d1_y, vfloat d1_z,
+	vfloat d2_x, vfloat d2_y, vfloat d2_z,
+	vfloat t_max,
+	float* t_out, float* a_out, float* b_out) {
+
+	const vfloat zero = vset1(0);
+	const vfloat one = vset1(1);
+
+	// s1 = dir x d2
+	const vfloat s1_x = vsub(vmul(dir_y, d2_z), vmul(dir_z, d2_y));
+	const vfloat s1_y = vsub(vmul(dir_z, d2_x), vmul(dir_x, d2_z));
+	const vfloat s1_z = vsub(vmul(dir_x, d2_y), vmul(dir_y, d2_x));
+
+	const vfloat div = vdot(s1_x, s1_y, s1_z, d1_x, d1_y, d1_z);
+	vfloat valid = vgt(div, zero);  // reject parallel or back
+	if(vmask(valid) == 0) {
+		return 0;
+	}
+	const vfloat div_inv = vdiv(one, div);
+
+	const vfloat s_x = vsub(org_x, p0_x);
+	const vfloat s_y = vsub(org_y, p0_y);
+	const vfloat s_z = vsub(org_z, p0_z);
+	const vfloat a = vmul(vdot(s_x, s_y, s_z, s1_x, s1_y, s1_z), div_inv);
+	valid = vand(valid, vand(vge(a, zero), vle(a, one)));
+
+	// s2 = s x d1
+	const vfloat s2_x = vsub(vmul(s_y, d1_z), vmul(s_z, d1_y));
+	const vfloat s2_y = vsub(vmul(s_z, d1_x), vmul(s_x, d1_z));
+	const vfloat s2_z = vsub(vmul(s_x, d1_y), vmul(s_y, d1_x));
+	const vfloat b = vmul(vdot(dir_x, dir_y, dir_z, s2_x, s2_y, s2_z), div_inv);
+	valid = vand(valid, vand(vge(b, zero), vle(vadd(a, b), one)));
+
+	const vfloat t = vmul(vdot(d2_x, d2_y, d2_z, s2_x, s2_y, s2_z), div_inv);
+	valid = vand(valid, vand(vge(t, zero), vlt(t, t_max)));
+
+	const int mask = vmask(valid);
+	if(mask != 0) {
+		vstore(t_out, t);
+		vstore(a_out, a);
+		vstore(b_out, b);
+	}
+	return mask;
+}
+
 Intersection::Intersection(
 	float t, Eigen::Vector3f pos, Eigen::Vector3f n, Eigen::Vector2f uv,
 	Colorf radiance, ObjectId id) :
@@ -12,16 +108,92 @@ Intersection::Intersection(
 Ray::Ray(Eigen::Vector3f org, Eigen::Vector3f dir) : org(org), dir(dir) {
 }
 
-Eigen::Vector3f Ray::at(float t) {
+Eigen::Vector3f Ray::at(float t) const {
 	return org + dir * t;
 }
 
 
+Hit::Hit() : t(std::numeric_limits<float>::infinity()), index(-1), a(0), b(0) {
+}
+
+
+RayPacket::RayPacket(const Ray* rays, int n) : size(n) {
+	assert(0 <= n && n <= simd_width);
+	for(int i = 0; i < simd_width; i++) {
+		const bool valid = i < n;
+		org_x[i] = valid ? rays[i].org.x() : 0;
+		org_y[i] = valid ? rays[i].org.y() : 0;
+		org_z[i] = valid ? rays[i].org.z() : 0;
+		dir_x[i] = valid ? rays[i].dir.x() : 0;
+		dir_y[i] = valid ? rays[i].dir.y() : 0;
+		dir_z[i] = valid ? rays[i].dir.z() : 0;
+	}
+}
+
+
+uint16_t floatToHalf(float f) {
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(x));
+	const uint16_t sign = (x >> 16) & 0x8000;
+	const int exponent = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = x & 0x7fffff;
+
+	if(((x >> 23) & 0xff) == 0xff) {
+		// inf or NaN
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	} else if(exponent >= 31) {
+		return sign | 0x7c00;
+	} else if(exponent <= 0) {
+		// Subnormal (or zero) in half.
+		if(exponent < -10) {
+			return sign;
+		}
+		mantissa |= 0x800000;
+		const int shift = 14 - exponent;
+		uint32_t h = mantissa >> shift;
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+		if(rest > halfway || (rest == halfway && (h & 1))) {
+			h++;
+		}
+		return sign | h;
+	}
+
+	// Carry of rounding goes to exponent, which is still correct.
+	uint32_t h = (exponent << 10) | (mantissa >> 13);
+	const uint32_t rest = mantissa & 0x1fff;
+	if(rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+		h++;
+	}
+	return sign | h;
+}
+
+float halfToFloat(uint16_t h) {
+	const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+	const int exponent = (h >> 10) & 0x1f;
+	const uint32_t mantissa = h & 0x3ff;
+
+	uint32_t x;
+	if(exponent == 0) {
+		// Zero or subnormal; mantissa * 2^-24.
+		const float f = mantissa / 16777216.0f;
+		return sign ? -f : f;
+	} else if(exponent == 31) {
+		x = sign | 0x7f800000 | (mantissa << 13);
+	} else {
+		x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	}
+	float f;
+	std::memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+
 Triangle::Triangle(Eigen::Vector3f p0, Eigen::Vector3f p1, Eigen::Vector3f p2) :
-	p0(p0), d1(p1 - p0), d2(p2 - p0), normal(d1.cross(d2).normalized()),
-	ir0({0, 0, 0}), ir1({0, 0, 0}), ir2({0, 0, 0}),
-	uv0({0, 0}), uv1({0, 0}), uv2({0, 0}) {
+	p0(p0), d1(p1 - p0), d2(p2 - p0),
+	uv0({0, 0}), uv1({0, 0}), uv2({0, 0}), normal(d1.cross(d2).normalized()) {
 	reflectance = Eigen::Vector3f(0.8, 0.8, 0.9);
+	irradiance.fill(0);
 }
 
 void Triangle::setUV(Eigen::Vector2f uv0, Eigen::Vector2f uv1, Eigen::Vector2f uv2) {
@@ -30,6 +202,15 @@ void Triangle::setUV(Eigen::Vector2f uv0, Eigen::Vector2f uv1, Eigen::Vector2f u
 	this->uv2 = uv2;
 }
 
+Triangle Triangle::transformed(const Eigen::Affine3f& trans) const {
+	Triangle tri = *this;
+	tri.p0 = trans * p0;
+	tri.d1 = trans.linear() * d1;
+	tri.d2 = trans.linear() * d2;
+	tri.normal = tri.d1.cross(tri.d2).normalized();
+	return tri;
+}
+
 boost::optional<Intersection> Triangle::intersect(Ray ray) {
 	Eigen::Vector3f s1 = ray.dir.cross(d2);
 	const float div = s1.dot(d1);
@@ -57,16 +238,26 @@ boost::optional<Intersection> Triangle::intersect(Ray ray) {
 		return boost::optional<Intersection>();
 	}
 
-	return boost::optional<Intersection>(Intersection(
-		t,
-		ray.at(t),
+	Hit hit;
+	hit.t = t;
+	hit.a = a;
+	hit.b = b;
+	return boost::optional<Intersection>(createIntersection(ray, hit));
+}
+
+Intersection Triangle::createIntersection(const Ray& ray, const Hit& hit) const {
+	const float a = hit.a;
+	const float b = hit.b;
+	return Intersection(
+		hit.t,
+		ray.at(hit.t),
 		normal,
 		(1 - a - b) * uv0 + a * uv1 + b * uv2,
-		(1 - a - b) * ir0 + a * ir1 + b * ir2,
-		attribute));
+		(1 - a - b) * getIrradiance(0) + a * getIrradiance(1) + b * getIrradiance(2),
+		attribute);
 }
 
-Eigen::Vector3f Triangle::getVertexPos(int i) {
+Eigen::Vector3f Triangle::getVertexPos(int i) const {
 	assert(0 <= i && i < 3);
 	if(i == 0) {
 		return p0;
@@ -77,12 +268,120 @@ Eigen::Vector3f Triangle::getVertexPos(int i) {
 	}
 }
 
-Eigen::Vector3f Triangle::getNormal() {
+Eigen::Vector3f Triangle::getNormal() const {
 	return normal;
 }
 
-Colorf Triangle::brdf() {
+Colorf Triangle::getIrradiance(int i) const {
+	assert(0 <= i && i < 3);
+	return Colorf(
+		halfToFloat(irradiance[3 * i + 0]),
+		halfToFloat(irradiance[3 * i + 1]),
+		halfToFloat(irradiance[3 * i + 2]));
+}
+
+void Triangle::setIrradiance(int i, Colorf ir) {
+	assert(0 <= i && i < 3);
+	for(int j = 0; j < 3; j++) {
+		irradiance[3 * i + j] = floatToHalf(ir[j]);
+	}
+}
+
+Colorf Triangle::brdf() const {
 	return reflectance / pi;
 }
 
+
+TriangleBlock::TriangleBlock() {
+	// Degenerate triangles at origin never pass the div > 0 test.
+	for(int i = 0; i < simd_width; i++) {
+		index[i] = -1;
+		p0_x[i] = p0_y[i] = p0_z[i] = 0;
+		d1_x[i] = d1_y[i] = d1_z[i] = 0;
+		d2_x[i] = d2_y[i] = d2_z[i] = 0;
+	}
+}
+
+void TriangleBlock::set(int slot, const Triangle& tri, int index) {
+	assert(0 <= slot && slot < simd_width);
+	this->index[slot] = index;
+	p0_x[slot] = tri.p0.x();
+	p0_y[slot] = tri.p0.y();
+	p0_z[slot] = tri.p0.z();
+	d1_x[slot] = tri.d1.x();
+	d1_y[slot] = tri.d1.y();
+	d1_z[slot] = tri.d1.z();
+	d2_x[slot] = tri.d2.x();
+	d2_y[slot] = tri.d2.y();
+	d2_z[slot] = tri.d2.z();
+}
+
+bool TriangleBlock::intersect(const Ray& ray, Hit& hit) const {
+	float ts[simd_width];
+	float as[simd_width];
+	float bs[simd_width];
+	const int mask = intersectLanes(
+		vset1(ray.org.x()), vset1(ray.org.y()), vset1(ray.org.z()),
+		vset1(ray.dir.x()), vset1(ray.dir.y()), vset1(ray.dir.z()),
+		vload(p0_x), vload(p0_y), vload(p0_z),
+		vload(d1_x), vload(d1_y), vload(d1_z),
+		vload(d2_x), vload(d2_y), vload(d2_z),
+		vset1(hit.t), ts, as, bs);
+	if(mask == 0) {
+		return false;
+	}
+
+	for(int i = 0; i < simd_width; i++) {
+		if((mask & (1 << i)) && ts[i] < hit.t) {
+			hit.t = ts[i];
+			hit.index = index[i];
+			hit.a = as[i];
+			hit.b = bs[i];
+		}
+	}
+	return true;
+}
+
+void TriangleBlock::intersect(const RayPacket& packet, Hit* hits) const {
+	float t_max[simd_width];
+	for(int i = 0; i < simd_width; i++) {
+		t_max[i] = (i < packet.size) ? hits[i].t : 0;
+	}
+
+	const vfloat org_x = vload(packet.org_x);
+	const vfloat org_y = vload(packet.org_y);
+	const vfloat org_z = vload(packet.org_z);
+	const vfloat dir_x = vload(packet.dir_x);
+	const vfloat dir_y = vload(packet.dir_y);
+	const vfloat dir_z = vload(packet.dir_z);
+
+	// Lanes are rays; loop over triangles.
+	for(int i_tri = 0; i_tri < simd_width; i_tri++) {
+		if(index[i_tri] < 0) {
+			continue;
+		}
+
+		float ts[simd_width];
+		float as[simd_width];
+		float bs[simd_width];
+		const int mask = intersectLanes(
+			org_x, org_y, org_z,
+			dir_x, dir_y, dir_z,
+			vset1(p0_x[i_tri]), vset1(p0_y[i_tri]), vset1(p0_z[i_tri]),
+			vset1(d1_x[i_tri]), vset1(d1_y[i_tri]), vset1(d1_z[i_tri]),
+			vset1(d2_x[i_tri]), vset1(d2_y[i_tri]), vset1(d2_z[i_tri]),
+			vload(t_max), ts, as, bs);
+
+		for(int i_ray = 0; i_ray < packet.size; i_ray++) {
+			if(mask & (1 << i_ray)) {
+				t_max[i_ray] = ts[i_ray];
+				hits[i_ray].t = ts[i_ray];
+				hits[i_ray].index = index[i_tri];
+				hits[i_ray].a = as[i_ray];
+				hits[i_ray].b = bs[i_ray];
+			}
+		}
+	}
+}
+
 }  // namespace
@@ -42,37 +42,89 @@ public:
 class Ray {
 public:
 	Ray(Eigen::Vector3f org, Eigen::Vector3f dir);
-	Eigen::Vector3f at(float t);
+	Eigen::Vector3f at(float t) const;
 
 	Eigen::Vector3f org;
 	Eigen::Vector3f dir;
 };
 
 
+// Number of lanes in TriangleBlock and RayPacket.
+// Depends on the instruction set we're compiled with (AVX or SSE).
+#ifdef __AVX__
+const int simd_width = 8;
+#else
+const int simd_width = 4;
+#endif
+
+
+// Result of ray-triangle test without shading info.
+// Cheap to keep around while searching for the nearest triangle.
+class Hit {
+public:
+	Hit();
+
+	// Nearest t so far, infinity when nothing was hit.
+	float t;
+
+	// Triangle index given to TriangleBlock::set, -1 when nothing was hit.
+	int index;
+
+	// Weights of vertex 1 and 2. (weight of vertex 0 is 1 - a - b)
+	float a;
+	float b;
+};
+
+
+// Up to simd_width rays in SoA layout.
+class RayPacket {
+public:
+	// n: number of rays (<= simd_width). Rest of the lanes never hit anything.
+	RayPacket(const Ray* rays, int n);
+
+	int size;
+
+	float org_x[simd_width];
+	float org_y[simd_width];
+	float org_z[simd_width];
+	float dir_x[simd_width];
+	float dir_y[simd_width];
+	float dir_z[simd_width];
+};
+
+
+// IEEE 754 binary16 (half) conversion. Rounds to nearest even, and overflow
+// becomes infinity.
+uint16_t floatToHalf(float f);
+float halfToFloat(uint16_t h);
+
+
 // Used for lighting.
+//
+// Ray traversal doesn't touch this; BVH leaves keep compact copies of p0, d1
+// and d2 in TriangleBlocks, and Triangle is only read to shade the nearest hit.
 class Triangle {
 public:
 	Triangle(Eigen::Vector3f p0, Eigen::Vector3f p1, Eigen::Vector3f p2);
 	boost::optional<Intersection> intersect(Ray ray);
 
+	// Build full Intersection from a Hit of this triangle.
+	Intersection createIntersection(const Ray& ray, const Hit& hit) const;
+
 	void setUV(Eigen::Vector2f uv0, Eigen::Vector2f uv1, Eigen::Vector2f uv2);
 
-	Eigen::Vector3f getVertexPos(int i);
-	Eigen::Vector3f getNormal();
+	// Return a copy moved by trans. Everything other than geometry is kept.
+	Triangle transformed(const Eigen::Affine3f& trans) const;
 
-	Colorf brdf();
-public:
-	// per-vertex irradiance.
-	// TODO: decide if these should be shared or not.
-	// pros of sharing:
-	// * typically 1/3 lighting computation
-	// cons of sharing:
-	// * more complex and inflexible architecture (needs mesh class)
-	// * slower lookup (due to de-referencing vertex info)
-	Colorf ir0;
-	Colorf ir1;
-	Colorf ir2;
+	Eigen::Vector3f getVertexPos(int i) const;
+	Eigen::Vector3f getNormal() const;
 
+	// Irradiance of vertex i. Stored in half precision.
+	Colorf getIrradiance(int i) const;
+	void setIrradiance(int i, Colorf ir);
+
+	Colorf brdf() const;
+public:
 	Eigen::Vector3f p0;
 	Eigen::Vector3f d1;
 	Eigen::Vector3f d2;
@@ -90,6 +142,41 @@ private:
 
 	// Lambert BRDF
 	Colorf reflectance;
+
+	// per-vertex irradiance (RGB of vertex 0, 1, 2) as half floats.
+	// Scene copies lighting results here for fast lookup during intersection.
+	// Half precision is plenty for lighting, and saves 18 bytes per triangle.
+	std::array<uint16_t, 9> irradiance;
+};
+
+
+// simd_width triangles in SoA layout, to test them against a ray at once.
+// Only contains geometry; use the Triangle (via Hit.index) for shading.
+class TriangleBlock {
+public:
+	// Empty block. Empty slots never hit anything.
+	TriangleBlock();
+
+	void set(int slot, const Triangle& tri, int index);
+
+	// Update hit when the ray hits any triangle nearer than hit.t.
+	// Return true when updated.
+	bool intersect(const Ray& ray, Hit& hit) const;
+
+	// Same as above, for each ray in packet. hits[i] corresponds to i-th ray.
+	void intersect(const RayPacket& packet, Hit* hits) const;
+public:
+	int index[simd_width];
+private:
+	float p0_x[simd_width];
+	float p0_y[simd_width];
+	float p0_z[simd_width];
+	float d1_x[simd_width];
+	float d1_y[simd_width];
+	float d1_z[simd_width];
+	float d2_x[simd_width];
+	float d2_y[simd_width];
+	float d2_z[simd_width];
 };
 
 }  // namespace
@@ -0,0 +1,960 @@
+#include "lighting.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <set>
+#include <tuple>
+
+#include "radiosity.h"
+#include "sampling.h"
+
+namespace construct {
+
+// Lowest blend rate of irradiance updates. Lighting keeps following
+// changes of neighbors even after many visits.
+const float min_blend_rate = 0.1;
+
+// Relative error to consider a vertex converged.
+const float max_noise = 0.03;
+
+typedef std::tuple<int, int, int, int, int, int> VertexKey;
+
+// Vertices with the same key are considered the same.
+VertexKey getVertexKey(const Eigen::Vector3f& pos, const Eigen::Vector3f& normal) {
+	// Corners closer than these are welded.
+	const float pos_quantum = 1e-4;
+	const float normal_quantum = 1e-2;
+
+	return VertexKey(
+		std::lround(pos.x() / pos_quantum),
+		std::lround(pos.y() / pos_quantum),
+		std::lround(pos.z() / pos_quantum),
+		std::lround(normal.x() / normal_quantum),
+		std::lround(normal.y() / normal_quantum),
+		std::lround(normal.z() / normal_quantum));
+}
+
+std::pair<int, int> getEdgeKey(int v0, int v1) {
+	return std::make_pair(std::min(v0, v1), std::max(v0, v1));
+}
+
+// Add vertex at pos to the cycle of coincident vertices.
+// pos_to_vertex: any vertex at each position
+void linkCoincident(std::map<VertexKey, int>& pos_to_vertex, std::vector<int>& coincident,
+	int vertex, const Eigen::Vector3f& pos) {
+	assert(vertex == coincident.size());
+	const VertexKey key = getVertexKey(pos, Eigen::Vector3f::Zero());
+	auto it = pos_to_vertex.find(key);
+	if(it == pos_to_vertex.end()) {
+		pos_to_vertex[key] = vertex;
+		coincident.push_back(vertex);
+	} else {
+		coincident.push_back(coincident[it->second]);
+		coincident[it->second] = vertex;
+	}
+}
+
+
+LightingFace::LightingFace() : children(-1), vertices({-1, -1, -1}) {
+}
+
+
+LightingChange::LightingChange() :
+	id(0), first_old(0), count_old(0), removed(false), first(0), baked(false) {
+}
+
+
+LightingScene::LightingScene() : version(0), base_version(-1), n_updates(0) {
+}
+
+LightingScene::LightingScene(const LightingScene& base, const std::vector<LightingChange>& changes) :
+	tris(base.tris), bvh(base.bvh), active(base.active),
+	version(base.version + 1), base_version(base.version), n_updates(base.n_updates) {
+	// Lighting only needs to redo places that can see these.
+	std::vector<std::pair<ObjectId, Eigen::AlignedBox3f>> bounds_of_changes;
+	std::set<ObjectId> baked_objects;
+	auto add_changed_bounds = [&](ObjectId id, int first, int count) {
+		Eigen::AlignedBox3f bounds;
+		for(int i = first; i < first + count; i++) {
+			for(int j = 0; j < 3; j++) {
+				bounds.extend(tris[i].getVertexPos(j));
+			}
+		}
+		if(!bounds.isEmpty()) {
+			bounds_of_changes.emplace_back(id, bounds);
+		}
+	};
+
+	for(const auto& change : changes) {
+		if(change.baked) {
+			baked_objects.insert(change.id);
+		} else {
+			add_changed_bounds(change.id, change.first_old, change.count_old);
+		}
+		std::fill_n(active.begin() + change.first_old, change.count_old, false);
+		if(change.removed) {
+			bvh.removeObject(change.id);
+			continue;
+		}
+
+		const int count = change.tris.size();
+		if(change.first + count > tris.size()) {
+			tris.resize(change.first + count,
+				Triangle(Eigen::Vector3f::Zero(), Eigen::Vector3f::UnitX(), Eigen::Vector3f::UnitY()));
+			active.resize(tris.size(), false);
+		}
+		std::copy(change.tris.begin(), change.tris.end(), tris.begin() + change.first);
+		std::fill_n(active.begin() + change.first, count, true);
+		bvh.setObject(change.id, tris, change.first, count);
+		if(!change.baked) {
+			add_changed_bounds(change.id, change.first, count);
+		}
+	}
+	for(const auto& pair : bounds_of_changes) {
+		changed_bounds.push_back(pair.second);
+		if(baked_objects.count(pair.first) == 0) {
+			unbaked_bounds.push_back(pair.second);
+		}
+	}
+	bvh.buildTop();
+	inheritFaces(base);
+	buildMesh();
+
+	for(const auto& change : changes) {
+		if(!change.baked) {
+			continue;
+		}
+		for(int i = 0; i < change.tris.size(); i++) {
+			for(int j = 0; j < 3; j++) {
+				LightingVertex& vertex = vertices[corners[change.first + i][j]];
+				vertex.baked = true;
+				vertex.converged = change.converged[3 * i + j];
+			}
+		}
+	}
+}
+
+void LightingScene::buildMesh() {
+	std::map<VertexKey, int> key_to_vertex;
+	std::map<VertexKey, int> pos_to_vertex;
+
+	vertices.clear();
+	midpoints.clear();
+	coincident.clear();
+	corners.assign(tris.size(), {-1, -1, -1});
+	if(faces.size() < tris.size()) {
+		faces.assign(tris.size(), LightingFace());
+	}
+	for(int i = 0; i < tris.size(); i++) {
+		if(!active[i]) {
+			faces[i] = LightingFace();
+			continue;
+		}
+
+		const auto& tri = tris[i];
+		const Eigen::Vector3f normal = tri.getNormal();
+		auto get_vertex = [&](const Eigen::Vector2f& ab) {
+			const Eigen::Vector3f pos = tri.p0 + ab.x() * tri.d1 + ab.y() * tri.d2;
+			const VertexKey key = getVertexKey(pos, normal);
+
+			auto it = key_to_vertex.find(key);
+			if(it == key_to_vertex.end()) {
+				it = key_to_vertex.insert(std::make_pair(key, vertices.size())).first;
+				linkCoincident(pos_to_vertex, coincident, vertices.size(), pos);
+				const Colorf ir =
+					(1 - ab.x() - ab.y()) * tri.getIrradiance(0) +
+					ab.x() * tri.getIrradiance(1) +
+					ab.y() * tri.getIrradiance(2);
+				vertices.push_back({pos, normal, tri.brdf(), ir, false, false});
+			}
+			return it->second;
+		};
+
+		// (face, (a, b) of its corners)
+		std::vector<std::pair<int, std::array<Eigen::Vector2f, 3>>> stack;
+		stack.emplace_back(i, std::array<Eigen::Vector2f, 3>({
+			Eigen::Vector2f(0, 0), Eigen::Vector2f(1, 0), Eigen::Vector2f(0, 1)}));
+		while(!stack.empty()) {
+			const int face = stack.back().first;
+			const auto ab = stack.back().second;
+			stack.pop_back();
+
+			for(int j = 0; j < 3; j++) {
+				faces[face].vertices[j] = get_vertex(ab[j]);
+			}
+
+			const int children = faces[face].children;
+			if(children >= 0) {
+				const Eigen::Vector2f m01 = (ab[0] + ab[1]) / 2;
+				const Eigen::Vector2f m12 = (ab[1] + ab[2]) / 2;
+				const Eigen::Vector2f m20 = (ab[2] + ab[0]) / 2;
+				const auto& v = faces[face].vertices;
+				midpoints[getEdgeKey(v[0], v[1])] = get_vertex(m01);
+				midpoints[getEdgeKey(v[1], v[2])] = get_vertex(m12);
+				midpoints[getEdgeKey(v[2], v[0])] = get_vertex(m20);
+				stack.emplace_back(children + 0, std::array<Eigen::Vector2f, 3>({ab[0], m01, m20}));
+				stack.emplace_back(children + 1, std::array<Eigen::Vector2f, 3>({m01, ab[1], m12}));
+				stack.emplace_back(children + 2, std::array<Eigen::Vector2f, 3>({m20, m12, ab[2]}));
+				stack.emplace_back(children + 3, std::array<Eigen::Vector2f, 3>({m12, m20, m01}));
+			}
+		}
+		corners[i] = faces[i].vertices;
+	}
+}
+
+void LightingScene::inheritFaces(const LightingScene& scene) {
+	faces.assign(tris.size(), LightingFace());
+	const int n = std::min(tris.size(), scene.tris.size());
+	for(int i = 0; i < std::min<int>(n, scene.faces.size()); i++) {
+		if(!active[i] || !scene.active[i] ||
+			tris[i].p0 != scene.tris[i].p0 ||
+			tris[i].d1 != scene.tris[i].d1 ||
+			tris[i].d2 != scene.tris[i].d2) {
+			continue;
+		}
+
+		// (face in scene, face in this)
+		std::vector<std::pair<int, int>> stack = {{i, i}};
+		while(!stack.empty()) {
+			const auto pair = stack.back();
+			stack.pop_back();
+
+			const int children = scene.faces[pair.first].children;
+			if(children < 0) {
+				continue;
+			}
+			faces[pair.second].children = faces.size();
+			for(int j = 0; j < 4; j++) {
+				stack.emplace_back(children + j, faces.size());
+				faces.emplace_back();
+			}
+		}
+	}
+}
+
+int LightingScene::subdivide(const std::vector<Colorf>& irradiance, int max_vertices) {
+	assert(irradiance.size() == vertices.size());
+	// Split when luminance of corners differ more than this, relative to
+	// their mean.
+	const float max_contrast = 0.3;
+	// Absolute floor of luminance, to ignore differences in dark places.
+	const float luminance_floor = 1;
+	// Don't split faces with edges shorter than this (m); hard shadows are
+	// sharp at any scale.
+	const float min_edge_length = 0.1;
+
+	// (contrast, leaf face)
+	std::vector<std::pair<float, int>> candidates;
+	std::vector<int> stack;
+	for(int i = 0; i < tris.size(); i++) {
+		if(active[i]) {
+			stack.push_back(i);
+		}
+	}
+	while(!stack.empty()) {
+		const int index = stack.back();
+		const auto& face = faces[index];
+		stack.pop_back();
+		if(face.children >= 0) {
+			for(int j = 0; j < 4; j++) {
+				stack.push_back(face.children + j);
+			}
+			continue;
+		}
+
+		float lum_min = std::numeric_limits<float>::infinity();
+		float lum_max = 0;
+		float edge_length = 0;
+		for(int j = 0; j < 3; j++) {
+			const float lum = irradiance[face.vertices[j]].mean();
+			lum_min = std::min(lum_min, lum);
+			lum_max = std::max(lum_max, lum);
+			edge_length = std::max(edge_length,
+				(vertices[face.vertices[j]].pos - vertices[face.vertices[(j + 1) % 3]].pos).norm());
+		}
+		const float contrast = (lum_max - lum_min) / ((lum_max + lum_min) / 2 + luminance_floor);
+		if(contrast > max_contrast && edge_length >= 2 * min_edge_length) {
+			candidates.emplace_back(contrast, index);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<float, int>>());
+
+	// Add vertices in place, so that existing vertices keep their indices.
+	std::map<VertexKey, int> key_to_vertex;
+	std::map<VertexKey, int> pos_to_vertex;
+	for(int i = 0; i < vertices.size(); i++) {
+		vertices[i].irradiance = irradiance[i];
+		key_to_vertex[getVertexKey(vertices[i].pos, vertices[i].normal)] = i;
+		pos_to_vertex[getVertexKey(vertices[i].pos, Eigen::Vector3f::Zero())] = i;
+	}
+	auto get_midpoint = [&](int v0, int v1) {
+		auto it_mid = midpoints.find(getEdgeKey(v0, v1));
+		if(it_mid != midpoints.end()) {
+			return it_mid->second;
+		}
+
+		const LightingVertex vertex0 = vertices[v0];
+		const LightingVertex vertex1 = vertices[v1];
+		const Eigen::Vector3f pos = (vertex0.pos + vertex1.pos) / 2;
+		const VertexKey key = getVertexKey(pos, vertex0.normal);
+
+		auto it = key_to_vertex.find(key);
+		if(it == key_to_vertex.end()) {
+			it = key_to_vertex.insert(std::make_pair(key, vertices.size())).first;
+			linkCoincident(pos_to_vertex, coincident, vertices.size(), pos);
+			vertices.push_back({pos, vertex0.normal, vertex0.brdf,
+				(vertex0.irradiance + vertex1.irradiance) / 2, false, false});
+		}
+		midpoints[getEdgeKey(v0, v1)] = it->second;
+		return it->second;
+	};
+
+	int n_splits = 0;
+	for(const auto& candidate : candidates) {
+		// Each split adds at most 3 vertices.
+		if(vertices.size() + 3 > max_vertices) {
+			break;
+		}
+
+		const auto v = faces[candidate.second].vertices;
+		const int m01 = get_midpoint(v[0], v[1]);
+		const int m12 = get_midpoint(v[1], v[2]);
+		const int m20 = get_midpoint(v[2], v[0]);
+
+		faces[candidate.second].children = faces.size();
+		const std::array<std::array<int, 3>, 4> children = {{
+			{v[0], m01, m20}, {m01, v[1], m12}, {m20, m12, v[2]}, {m12, m20, m01}}};
+		for(const auto& child : children) {
+			LightingFace face;
+			face.vertices = child;
+			faces.push_back(face);
+		}
+		n_splits++;
+	}
+	return n_splits;
+}
+
+void LightingScene::getWeights(const Hit& hit,
+	std::array<int, 3>& vertices, Eigen::Vector3f& weights) const {
+	// Descend to the leaf containing hit, keeping (a, b) local to the face.
+	int face = hit.index;
+	float a = hit.a;
+	float b = hit.b;
+	while(faces[face].children >= 0) {
+		const int children = faces[face].children;
+		a *= 2;
+		b *= 2;
+		if(a >= 1) {
+			face = children + 1;
+			a -= 1;
+		} else if(b >= 1) {
+			face = children + 2;
+			b -= 1;
+		} else if(a + b <= 1) {
+			face = children + 0;
+		} else {
+			face = children + 3;
+			a = 1 - a;
+			b = 1 - b;
+		}
+	}
+	vertices = faces[face].vertices;
+	weights = Eigen::Vector3f(1 - a - b, a, b);
+}
+
+std::vector<std::vector<LightingPoint>> LightingScene::getLeafPolygons(int first, int count) const {
+	auto find_midpoint = [&](int v0, int v1) {
+		auto it = midpoints.find(getEdgeKey(v0, v1));
+		return (it != midpoints.end()) ? it->second : -1;
+	};
+
+	std::vector<std::vector<LightingPoint>> polygons;
+	std::vector<int> stack;
+	for(int i = first; i < first + count; i++) {
+		if(!active[i]) {
+			continue;
+		}
+		stack.push_back(i);
+		while(!stack.empty()) {
+			const LightingFace& face = faces[stack.back()];
+			stack.pop_back();
+			if(face.children >= 0) {
+				for(int j = 0; j < 4; j++) {
+					stack.push_back(face.children + j);
+				}
+				continue;
+			}
+
+			std::vector<LightingPoint> polygon;
+			for(int j = 0; j < 3; j++) {
+				const int v0 = face.vertices[j];
+				const int v1 = face.vertices[(j + 1) % 3];
+				polygon.push_back({v0, v0, 0});
+
+				// Find who split this edge: a neighbor sharing our vertices,
+				// or one across a crease with its own vertices.
+				int u0 = v0;
+				int u1 = v1;
+				if(find_midpoint(v0, v1) < 0) {
+					for(int w0 = coincident[v0]; w0 != v0 && u0 == v0; w0 = coincident[w0]) {
+						for(int w1 = coincident[v1]; w1 != v1; w1 = coincident[w1]) {
+							if(find_midpoint(w0, w1) >= 0) {
+								u0 = w0;
+								u1 = w1;
+								break;
+							}
+						}
+					}
+				}
+				const bool own = u0 == v0;
+
+				// Midpoints of (u0, u1) in order, recursively.
+				std::function<void(int, int, float, float)> add_midpoints =
+					[&](int w0, int w1, float t0, float t1) {
+						const int m = find_midpoint(w0, w1);
+						if(m < 0) {
+							return;
+						}
+						const float t = (t0 + t1) / 2;
+						add_midpoints(w0, m, t0, t);
+						if(own) {
+							polygon.push_back({m, m, 0});
+						} else {
+							polygon.push_back({v0, v1, t});
+						}
+						add_midpoints(m, w1, t, t1);
+					};
+				add_midpoints(u0, u1, 0, 1);
+			}
+			polygons.push_back(polygon);
+		}
+	}
+	return polygons;
+}
+
+
+Colorf LightingResult::getRadiance(const Hit& hit) const {
+	std::array<int, 3> vertices;
+	Eigen::Vector3f weights;
+	scene->getWeights(hit, vertices, weights);
+	return
+		weights[0] * irradiance[vertices[0]] +
+		weights[1] * irradiance[vertices[1]] +
+		weights[2] * irradiance[vertices[2]];
+}
+
+
+Lighting::Lighting(std::shared_ptr<const SkyRadianceMap> sky_map, int n_threads,
+	LightingMode mode, int max_vertices) :
+	sky_map_pending(sky_map), acknowledged_serial(0),
+	result_serial(0), log_base(0), n_logged(0), mode(mode), radiosity_converged(false),
+	n_threads(n_threads), max_vertices(max_vertices), stop(false),
+	job(nullptr), job_serial(0), n_busy_workers(0), stop_workers(false) {
+	if(this->n_threads <= 0) {
+		this->n_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+	}
+
+	for(int i_thread = 1; i_thread < this->n_threads; i_thread++) {
+		workers.emplace_back(&Lighting::runWorker, this, i_thread);
+	}
+	thread = std::thread(&Lighting::run, this);
+}
+
+Lighting::~Lighting() {
+	stop = true;
+	thread.join();
+
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		stop_workers = true;
+	}
+	job_started.notify_all();
+	for(auto& worker : workers) {
+		worker.join();
+	}
+}
+
+void Lighting::setScene(std::shared_ptr<const LightingScene> scene) {
+	std::atomic_store(&scene_pending, scene);
+}
+
+void Lighting::updateGeometry(std::vector<LightingChange> changes) {
+	std::lock_guard<std::mutex> lock(updates_mutex);
+	updates_pending.push_back(std::move(changes));
+}
+
+void Lighting::setSkyMap(std::shared_ptr<const SkyRadianceMap> sky_map) {
+	std::atomic_store(&sky_map_pending, sky_map);
+}
+
+std::shared_ptr<const LightingResult> Lighting::getResult() {
+	return std::atomic_load(&result);
+}
+
+void Lighting::acknowledgeResult(int serial) {
+	acknowledged_serial = serial;
+}
+
+void Lighting::run() {
+	while(!stop) {
+		auto sky_map_new = std::atomic_load(&sky_map_pending);
+		if(sky_map_new != sky_map) {
+			sky_map = sky_map_new;
+			invalidateAll();
+			if(radiosity) {
+				radiosity->setSky(*sky_map);
+				radiosity_converged = false;
+			}
+		}
+
+		// Taken, so that scenes built from updates aren't reverted to it.
+		auto scene_new = std::atomic_exchange(&scene_pending, std::shared_ptr<const LightingScene>());
+		if(scene_new && scene_new != scene) {
+			switchScene(scene_new);
+		}
+
+		// Welding is O(scene); do it here rather than on the render thread.
+		std::vector<std::vector<LightingChange>> updates;
+		{
+			std::lock_guard<std::mutex> lock(updates_mutex);
+			updates.swap(updates_pending);
+		}
+		if(!updates.empty()) {
+			std::vector<LightingChange> changes;
+			for(const auto& update : updates) {
+				changes.insert(changes.end(), update.begin(), update.end());
+			}
+			const LightingScene empty;
+			auto scene_changed = std::make_shared<LightingScene>(scene ? *scene : empty, changes);
+			scene_changed->n_updates += updates.size();
+			switchScene(scene_changed);
+		}
+
+		if(!step()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+}
+
+void Lighting::switchScene(std::shared_ptr<const LightingScene> scene_new) {
+	// Changes are only known relative to base_version. If we skipped a scene,
+	// we don't know what changed.
+	const bool incremental = scene && scene_new &&
+		scene_new->base_version >= 0 && scene_new->base_version == scene->version;
+
+	std::map<VertexKey, int> key_to_vertex_old;
+	if(incremental) {
+		for(int i = 0; i < scene->vertices.size(); i++) {
+			key_to_vertex_old[getVertexKey(scene->vertices[i].pos, scene->vertices[i].normal)] = i;
+		}
+	}
+	std::vector<Colorf> irradiance_old;
+	std::vector<uint32_t> sample_indices_old;
+	std::vector<int> visits_old;
+	std::vector<float> variances_old;
+	irradiance_old.swap(irradiance);
+	sample_indices_old.swap(sample_indices);
+	visits_old.swap(visits);
+	variances_old.swap(variances);
+
+	// Vertex indices change; results of the new scene start a new log.
+	update_log.clear();
+	n_logged = 0;
+	updated.clear();
+	log_base = result_serial;
+
+	scene = scene_new;
+	const int n_vertices = scene ? scene->vertices.size() : 0;
+	irradiance.assign(n_vertices, Colorf(0, 0, 0));
+	sample_indices.assign(n_vertices, 0);
+	visits.assign(n_vertices, 0);
+	variances.assign(n_vertices, std::numeric_limits<float>::infinity());
+
+	for(int i = 0; i < n_vertices; i++) {
+		const auto& vertex = scene->vertices[i];
+		auto it = key_to_vertex_old.find(getVertexKey(vertex.pos, vertex.normal));
+		const bool carried = it != key_to_vertex_old.end();
+		if(carried) {
+			const int i_old = it->second;
+			irradiance[i] = irradiance_old[i_old];
+			sample_indices[i] = sample_indices_old[i_old];
+			visits[i] = visits_old[i_old];
+			variances[i] = variances_old[i_old];
+		}
+
+		if(vertex.baked) {
+			// A bake is better than what we got since launch. Converged ones
+			// are as if blended at the lowest rate, without noise.
+			irradiance[i] = vertex.irradiance;
+			visits[i] = vertex.converged ? std::ceil(1 / min_blend_rate) : 1;
+			variances[i] = vertex.converged ? 0 : std::numeric_limits<float>::infinity();
+		} else if(!carried) {
+			irradiance[i] = vertex.irradiance;
+			visits[i] = (irradiance[i].mean() > 0) ? 1 : 0;
+			continue;
+		}
+
+		// A bake already includes (e.g. when they're sent together) objects
+		// that are baked too.
+		for(const auto& bounds : vertex.baked ? scene->unbaked_bounds : scene->changed_bounds) {
+			if(canSee(vertex.pos, vertex.normal, bounds)) {
+				visits[i] = std::min(visits[i], 1);
+				variances[i] = std::numeric_limits<float>::infinity();
+				break;
+			}
+		}
+	}
+
+	// Subdivision only appends vertices, so most of F can be kept.
+	const bool refined = incremental && scene->changed_bounds.empty() &&
+		scene->vertices.size() >= irradiance_old.size();
+	if(mode == RADIOSITY && n_vertices > 0) {
+		const int n_rays = 256;
+		if(refined && radiosity) {
+			radiosity.reset(new Radiosity(*radiosity, scene));
+		} else {
+			radiosity.reset(new Radiosity(scene, n_rays, n_threads));
+		}
+		radiosity->setSky(*sky_map);
+		radiosity_converged = false;
+	} else {
+		radiosity.reset();
+	}
+}
+
+bool Lighting::canSee(const Eigen::Vector3f& pos, const Eigen::Vector3f& normal,
+	const Eigen::AlignedBox3f& bounds) const {
+	// Ignore objects covering less than this fraction of the hemisphere
+	// (roughly); their effect is below noise.
+	const float min_solid_angle_ratio = 0.01;
+
+	if(bounds.contains(pos)) {
+		return true;
+	}
+
+	// Sun shadow can reach far.
+	const Eigen::Vector3f sun_direction = sky_map->getSunDirection();
+	if(normal.dot(sun_direction) > 0) {
+		const Eigen::Vector3f dir_inv = sun_direction.cwiseInverse();
+		const Eigen::Vector3f t0 = (bounds.min() - pos).cwiseProduct(dir_inv);
+		const Eigen::Vector3f t1 = (bounds.max() - pos).cwiseProduct(dir_inv);
+		if(t0.cwiseMin(t1).maxCoeff() <= t0.cwiseMax(t1).minCoeff() &&
+			t0.cwiseMax(t1).minCoeff() >= 0) {
+			return true;
+		}
+	}
+
+	// Behind the surface?
+	bool in_front = false;
+	for(int i = 0; i < 8; i++) {
+		const Eigen::Vector3f corner = bounds.corner(static_cast<Eigen::AlignedBox3f::CornerType>(i));
+		if(normal.dot(corner - pos) > 0) {
+			in_front = true;
+			break;
+		}
+	}
+	if(!in_front) {
+		return false;
+	}
+
+	// Too small or far?
+	const float radius = bounds.diagonal().norm() / 2;
+	const float distance = (bounds.center() - pos).norm();
+	return std::pow(radius / distance, 2) >= min_solid_angle_ratio;
+}
+
+float Lighting::getNoise(int i) const {
+	// Don't trust variance from too few updates.
+	const int min_visits = 3;
+	// Absolute floor of luminance, to ignore noise in dark places.
+	const float luminance_floor = 1;
+
+	if(visits[i] < min_visits) {
+		return std::numeric_limits<float>::infinity();
+	}
+
+	// Variance of blended irradiance (exponential moving average of updates).
+	const float ratio = std::max(1.0f / visits[i], min_blend_rate / (2 - min_blend_rate));
+	return std::sqrt(variances[i] * ratio) / (irradiance[i].mean() + luminance_floor);
+}
+
+void Lighting::invalidateAll() {
+	for(int i = 0; i < irradiance.size(); i++) {
+		// Non-black irradiance is a valid (but maybe stale) estimate.
+		visits[i] = (irradiance[i].mean() > 0) ? 1 : 0;
+		variances[i] = std::numeric_limits<float>::infinity();
+	}
+}
+
+bool Lighting::step() {
+	if(radiosity) {
+		return stepRadiosity();
+	}
+
+	// Budget of a step. Large enough to keep all threads busy, small enough
+	// to pick up new geometry quickly. It doesn't depend on # of threads,
+	// so that results don't either.
+	const int max_vertices_per_step = 512;
+
+	// Pick noisiest vertices.
+	std::vector<std::pair<float, int>> candidates;
+	for(int i = 0; i < irradiance.size(); i++) {
+		const float noise = getNoise(i);
+		if(noise > max_noise) {
+			candidates.emplace_back(noise, i);
+		}
+	}
+	if(candidates.empty()) {
+		// Also when nothing needed lighting since switching scenes (e.g. a
+		// far object was removed); the render thread waits for a result of
+		// the latest scene.
+		auto result_last = std::atomic_load(&result);
+		if(scene && (!result_last || result_last->scene != scene || !result_last->converged)) {
+			publish(true);
+			return refine();
+		}
+		return false;
+	}
+
+	const int n_vertices = std::min<int>(max_vertices_per_step, candidates.size());
+	std::nth_element(candidates.begin(), candidates.begin() + (n_vertices - 1), candidates.end(),
+		std::greater<std::pair<float, int>>());
+
+	// Workers only read irradiance and write to their own slice of results,
+	// so that they never see half-updated irradiance of other workers.
+	std::vector<Colorf> results(n_vertices);
+	auto worker = [&](int i_thread) {
+		for(int i = i_thread; i < n_vertices; i += n_threads) {
+			const int index = candidates[i].second;
+			const auto& vertex = scene->vertices[index];
+			const Colorf ir =
+				collectIrradiance(vertex.pos, vertex.normal,
+					sample_indices[index], hashToUnitSquare(index)) +
+				collectSunIrradiance(vertex.pos, vertex.normal);
+			results[i] = ir.cwiseProduct(vertex.brdf);
+		}
+	};
+
+	runParallel(worker);
+
+	for(int i = 0; i < n_vertices; i++) {
+		const int index = candidates[i].second;
+		auto& ir = irradiance[index];
+
+		// Running mean at first, then exponential moving average.
+		const float diff = results[i].mean() - ir.mean();
+		if(visits[index] > 0) {
+			const float blend_var = std::max(1.0f / visits[index], min_blend_rate);
+			variances[index] = std::isfinite(variances[index]) ?
+				(1 - blend_var) * variances[index] + blend_var * diff * diff :
+				diff * diff;
+		}
+		visits[index]++;
+		const float blend_rate = std::max(1.0f / visits[index], min_blend_rate);
+		ir = (1 - blend_rate) * ir + blend_rate * results[i];
+		updated.push_back(index);
+	}
+
+	publish(false);
+	return true;
+}
+
+bool Lighting::stepRadiosity() {
+	// Max relative change of an iteration to consider converged.
+	const float max_change = 1e-3;
+
+	if(radiosity_converged) {
+		return false;
+	}
+	radiosity_converged = radiosity->iterate(irradiance) < max_change;
+	// Every vertex gathers from the others.
+	for(int i = 0; i < irradiance.size(); i++) {
+		updated.push_back(i);
+	}
+	publish(radiosity_converged);
+	if(radiosity_converged) {
+		refine();
+	}
+	return true;
+}
+
+bool Lighting::refine() {
+	if(max_vertices <= 0) {
+		return false;
+	}
+
+	// Now that gradients are reliable, put more vertices where they're sharp.
+	// switchScene keeps converged state of existing vertices.
+	auto scene_new = std::make_shared<LightingScene>(*scene);
+	if(scene_new->subdivide(irradiance, max_vertices) == 0) {
+		return false;
+	}
+	// Baked irradiance was taken when switching to scene.
+	for(auto& vertex : scene_new->vertices) {
+		vertex.baked = false;
+	}
+	scene_new->version = scene->version + 1;
+	scene_new->base_version = scene->version;
+	scene_new->changed_bounds.clear();
+	scene_new->unbaked_bounds.clear();
+	switchScene(scene_new);
+	return true;
+}
+
+void Lighting::runParallel(const std::function<void(int)>& job) {
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		this->job = &job;
+		job_serial++;
+		n_busy_workers = workers.size();
+	}
+	job_started.notify_all();
+
+	job(0);
+
+	std::unique_lock<std::mutex> lock(job_mutex);
+	job_finished.wait(lock, [this] {
+		return n_busy_workers == 0;
+	});
+	this->job = nullptr;
+}
+
+void Lighting::runWorker(int i_thread) {
+	int last_serial = 0;
+	while(true) {
+		const std::function<void(int)>* current_job;
+		{
+			std::unique_lock<std::mutex> lock(job_mutex);
+			job_started.wait(lock, [&] {
+				return stop_workers || job_serial != last_serial;
+			});
+			if(stop_workers) {
+				return;
+			}
+			last_serial = job_serial;
+			current_job = job;
+		}
+
+		(*current_job)(i_thread);
+
+		bool last;
+		{
+			std::lock_guard<std::mutex> lock(job_mutex);
+			last = --n_busy_workers == 0;
+		}
+		if(last) {
+			job_finished.notify_one();
+		}
+	}
+}
+
+void Lighting::publish(bool converged) {
+	result_serial++;
+
+	// Forget what the render thread already has.
+	const int acknowledged = acknowledged_serial;
+	while(!update_log.empty() && update_log.front().first <= acknowledged) {
+		n_logged -= update_log.front().second.size();
+		update_log.pop_front();
+	}
+	log_base = std::max(log_base, acknowledged);
+	n_logged += updated.size();
+	update_log.emplace_back(result_serial, std::vector<int>());
+	update_log.back().second.swap(updated);
+
+	// When nobody acknowledges for a while, listing everything is cheaper.
+	if(n_logged > irradiance.size()) {
+		update_log.clear();
+		update_log.emplace_back(result_serial, std::vector<int>(irradiance.size()));
+		std::iota(update_log.back().second.begin(), update_log.back().second.end(), 0);
+		n_logged = irradiance.size();
+	}
+
+	auto result_new = std::make_shared<LightingResult>();
+	result_new->scene = scene;
+	result_new->irradiance = irradiance;
+	result_new->converged = converged;
+	// In RADIOSITY mode, vertices converge together.
+	result_new->vertex_converged.assign(irradiance.size(), converged);
+	if(!converged && !radiosity) {
+		for(int i = 0; i < irradiance.size(); i++) {
+			result_new->vertex_converged[i] = getNoise(i) <= max_noise;
+		}
+	}
+	result_new->serial = result_serial;
+	result_new->base_serial = log_base;
+	for(const auto& entry : update_log) {
+		result_new->updated.insert(result_new->updated.end(),
+			entry.second.begin(), entry.second.end());
+	}
+	std::sort(result_new->updated.begin(), result_new->updated.end());
+	result_new->updated.erase(
+		std::unique(result_new->updated.begin(), result_new->updated.end()),
+		result_new->updated.end());
+	std::atomic_store(&result, std::shared_ptr<const LightingResult>(result_new));
+}
+
+Colorf Lighting::getRadiance(const Ray& ray) {
+	const Hit hit = scene->bvh.closestHit(ray);
+	if(hit.index < 0) {
+		return sky_map->getRadianceAt(ray.dir);
+	}
+
+	std::array<int, 3> vertices;
+	Eigen::Vector3f weights;
+	scene->getWeights(hit, vertices, weights);
+	return
+		weights[0] * irradiance[vertices[0]] +
+		weights[1] * irradiance[vertices[1]] +
+		weights[2] * irradiance[vertices[2]];
+}
+
+Colorf Lighting::collectIrradiance(Eigen::Vector3f pos, Eigen::Vector3f normal,
+	uint32_t& sample_index, Eigen::Vector2f offset) {
+	// Stop when standard error of mean luminance is below
+	// max(rel_error * mean, abs_error).
+	const int min_samples = 4;
+	const int max_samples = 16;
+	const float rel_error = 0.1;
+	const float abs_error = 1e-3;
+
+	Colorf accum(0, 0, 0);
+	SampleStats stats;
+	while(stats.getCount() < max_samples) {
+		auto dir = sampleCosineHemisphere(sampleHalton2(sample_index++, offset), normal);
+		Ray ray(pos + normal * 1e-5, dir);
+		const Colorf radiance = getRadiance(ray);
+		accum += radiance;
+		stats.add(radiance.mean());
+
+		if(stats.getCount() >= min_samples &&
+			stats.getError() <= std::max(rel_error * stats.getMean(), abs_error)) {
+			break;
+		}
+	}
+	assert(std::isfinite(accum[0]) && std::isfinite(accum[1]) && std::isfinite(accum[2]));
+
+	// With pdf = cos / pi, mean(radiance) * pi estimates the integral.
+	// Divide by 2 pi to keep the scale of uniform sampling.
+	return accum / stats.getCount() / 2;
+}
+
+Colorf Lighting::collectSunIrradiance(Eigen::Vector3f pos, Eigen::Vector3f normal) {
+	const Eigen::Vector3f sun_direction = sky_map->getSunDirection();
+	const float cos = normal.dot(sun_direction);
+	if(cos <= 0) {
+		return Colorf(0, 0, 0);
+	}
+
+	Ray ray(pos + normal * 1e-5, sun_direction);
+	if(scene->bvh.occluded(ray, std::numeric_limits<float>::infinity())) {
+		return Colorf(0, 0, 0);
+	}
+	return sky_map->getSunIrradiance() * cos / (2 * pi);
+}
+
+}  // namespace
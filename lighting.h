@@ -0,0 +1,353 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+
+#include "bvh.h"
+#include "light.h"
+#include "sky.h"
+#include "util.h"
+
+namespace construct {
+
+class Radiosity;
+
+enum LightingMode {
+	// Monte Carlo gathering; rays are cast continuously.
+	GATHER,
+	// Form factors are computed once per geometry, then iterated
+	// without rays. Better for large static scenes.
+	RADIOSITY,
+};
+
+// Vertex shared by triangle corners with the same position & normal.
+class LightingVertex {
+public:
+	Eigen::Vector3f pos;
+	Eigen::Vector3f normal;
+	Colorf brdf;
+
+	// Interpolated from irradiance of tris. Initial state of lighting.
+	Colorf irradiance;
+
+	// irradiance is from IrradianceBake. Lighting starts from it even when
+	// it has its own state of the vertex.
+	bool baked;
+	// Baked irradiance had converged when saved.
+	bool converged;
+};
+
+
+// Part of a triangle lit by its own vertices. Splitting a face adds
+// vertices at midpoints of its edges, and makes 4 children:
+//   (v0, m01, m20), (m01, v1, m12), (m20, m12, v2), (m12, m20, m01)
+class LightingFace {
+public:
+	LightingFace();
+
+	// Index of first of 4 consecutive children in faces, or -1 for leaves.
+	int children;
+
+	// Vertex index of each corner. -1 for inactive tris.
+	std::array<int, 3> vertices;
+};
+
+
+// Point on the boundary of a leaf face, at
+// vertices[v0].pos * (1 - t) + vertices[v1].pos * t (same for irradiance).
+class LightingPoint {
+public:
+	int v0;
+	int v1;
+	float t;
+};
+
+
+// Replacement of the triangles of a STATIC object, sent by the render thread
+// to Lighting. The sender allocates slots of tris, so that both threads agree
+// on triangle indices.
+class LightingChange {
+public:
+	LightingChange();
+
+	ObjectId id;
+
+	// Slots the object had. They're freed before taking new ones.
+	// count_old is 0 for new objects.
+	int first_old;
+	int count_old;
+
+	// true when the object is gone. Otherwise it's tris, put at first.
+	bool removed;
+	int first;
+	std::vector<Triangle> tris;
+
+	// Irradiance of tris is from IrradianceBake, and tris are the same as
+	// the old ones (so they're not in changed_bounds). Corners become baked
+	// vertices.
+	bool baked;
+	// Per corner of tris, when baked: irradiance had converged when saved.
+	std::vector<bool> converged;
+};
+
+
+// Immutable static geometry. Built by the lighting thread from LightingChanges,
+// and shared with the render thread through LightingResult.
+class LightingScene {
+public:
+	LightingScene();
+
+	// base with changes applied in order: tris, active, bvh, then faces of
+	// unchanged tris and the mesh. changed_bounds covers old and new tris
+	// of changes. n_updates is left as base's.
+	LightingScene(const LightingScene& base, const std::vector<LightingChange>& changes);
+
+	// Weld corners of active tris (and their faces) into vertices.
+	// Call after tris, active and (optionally) faces are set.
+	void buildMesh();
+
+	// Copy subdivision of tris that are the same in scene (e.g. objects
+	// that didn't change). Call before buildMesh.
+	void inheritFaces(const LightingScene& scene);
+
+	// Split leaf faces where irradiance (of vertices) changes sharply,
+	// sharpest first, as long as # of vertices stays below max_vertices.
+	// New vertices are appended. Return # of split faces.
+	int subdivide(const std::vector<Colorf>& irradiance, int max_vertices);
+
+	// Vertices and their weights to interpolate per-vertex values at hit
+	// (of tris[hit.index]).
+	void getWeights(const Hit& hit, std::array<int, 3>& vertices, Eigen::Vector3f& weights) const;
+
+	// Boundary of each leaf face of tris [first, first + count), in the order
+	// of its corners. Besides corners, it has points where neighbors (also
+	// across creases) split the shared edge, so that meshes made of these
+	// polygons have no T-junctions.
+	std::vector<std::vector<LightingPoint>> getLeafPolygons(int first, int count) const;
+
+	// Irradiance in tris is used as the initial state of lighting.
+	std::vector<Triangle> tris;
+	TwoLevelBVH bvh;
+
+	// false for unused slots of tris. (they're not in bvh either)
+	std::vector<bool> active;
+
+	// Lighting is calculated per vertex, not per corner (~1/3 of work).
+	std::vector<LightingVertex> vertices;
+	// Vertex index of each corner of tris. -1 for inactive tris.
+	std::vector<std::array<int, 3>> corners;
+	// Subdivision of tris for lighting. faces[i] (i < tris.size()) is the
+	// whole tris[i], and the rest are their descendants.
+	std::vector<LightingFace> faces;
+	// Midpoint vertex of each split edge, keyed by (smaller, larger) vertex.
+	std::map<std::pair<int, int>, int> midpoints;
+	// Next vertex at the same position (with another normal), cyclic.
+	std::vector<int> coincident;
+
+	// Scenes are numbered in order of creation.
+	int version;
+	// Bounds of objects added, removed or modified since the scene of
+	// base_version. Lighting keeps its converged state for vertices that
+	// can't see them.
+	// base_version < 0 means everything changed. No bounds means faces were
+	// only subdivided, keeping vertices of the base as a prefix.
+	int base_version;
+	std::vector<Eigen::AlignedBox3f> changed_bounds;
+	// Part of changed_bounds that baked vertices need to care about; the bake
+	// was lit with objects that are baked too.
+	std::vector<Eigen::AlignedBox3f> unbaked_bounds;
+
+	// # of Lighting::updateGeometry calls applied, so that the sender knows
+	// when tris have the same layout as its own.
+	int n_updates;
+};
+
+
+// Snapshot of lighting state, published by Lighting.
+class LightingResult {
+public:
+	// Geometry this result was calculated for.
+	std::shared_ptr<const LightingScene> scene;
+
+	// Irradiance of each vertex in scene->vertices.
+	std::vector<Colorf> irradiance;
+
+	// true when every vertex is below noise threshold, and lighting is idle
+	// until geometry or sky changes.
+	bool converged;
+	// Same for each vertex.
+	std::vector<bool> vertex_converged;
+
+	// Results are numbered in order of publishing.
+	int serial;
+	// Vertices whose irradiance changed since the result of base_serial,
+	// sorted. Only meaningful when that result is for the same scene.
+	int base_serial;
+	std::vector<int> updated;
+
+	// Radiance at hit (of scene->tris), interpolated from irradiance.
+	Colorf getRadiance(const Hit& hit) const;
+};
+
+
+// Runs lighting in the background, so that render thread never
+// waits for it. Geometry goes in and results come out as immutable snapshots,
+// exchanged by atomic pointer swaps.
+//
+// Each step lights the noisiest vertices (new vertices first), and lighting
+// stops when all vertices are converged.
+class Lighting {
+public:
+	// sky_map: used for the Sun (direct light) and rays escaping the scene
+	// n_threads: # of threads doing lighting, including the lighting thread
+	//   itself. 0 means # of cores - 1 (at least 1), leaving a core for
+	//   the render thread.
+	// max_vertices: converged scenes are subdivided up to this many vertices.
+	//   0 means never.
+	Lighting(std::shared_ptr<const SkyRadianceMap> sky_map, int n_threads = 0,
+		LightingMode mode = GATHER, int max_vertices = 0);
+	~Lighting();
+
+	// Replace geometry. Lighting thread picks it up after current batch.
+	void setScene(std::shared_ptr<const LightingScene> scene);
+
+	// Apply changes to current geometry. Cheap for the caller; lighting
+	// thread builds the new LightingScene after current batch. Results show
+	// it in LightingScene::n_updates.
+	void updateGeometry(std::vector<LightingChange> changes);
+
+	// Replace sky (e.g. when the Sun moved). Picked up after current batch.
+	void setSkyMap(std::shared_ptr<const SkyRadianceMap> sky_map);
+
+	// Return latest result (might be for older geometry), or nullptr.
+	std::shared_ptr<const LightingResult> getResult();
+
+	// Tell that the result of serial has been applied, so that later results
+	// only list vertices updated since then.
+	void acknowledgeResult(int serial);
+private:
+	void run();
+
+	// Light a few vertices and publish the result.
+	// Return false when there was nothing to do.
+	bool step();
+
+	// step() for RADIOSITY mode.
+	bool stepRadiosity();
+
+	// Split faces where converged irradiance changes sharply, and switch to
+	// the subdivided scene. Return true when anything was split.
+	bool refine();
+
+	void publish(bool converged);
+
+	// Call job(i_thread) for each i_thread in [0, n_threads) in parallel,
+	// and return when all of them are done.
+	void runParallel(const std::function<void(int)>& job);
+
+	// Body of workers (i_thread > 0) of runParallel.
+	void runWorker(int i_thread);
+
+	// Estimated relative error of irradiance[i]. Infinity when unknown.
+	float getNoise(int i) const;
+
+	// Forget convergence of all vertices (but keep irradiance).
+	void invalidateAll();
+
+	// Replace scene, carrying over state of vertices not affected by
+	// scene_new->changed_bounds when possible.
+	void switchScene(std::shared_ptr<const LightingScene> scene_new);
+
+	// Return true when a vertex at pos (facing normal) can be affected by
+	// a change inside bounds.
+	bool canSee(const Eigen::Vector3f& pos, const Eigen::Vector3f& normal,
+		const Eigen::AlignedBox3f& bounds) const;
+
+	// Radiance toward ray.org, interpolated from irradiance of vertices.
+	Colorf getRadiance(const Ray& ray);
+
+	// Approximate integral(irradiance(pos, -dir_in) * normal(pos).dot(dir_in) for dir_in in sphere) / (2 pi)
+	// return value: radiance
+	// Takes more samples where variance is high.
+	// Directions are cosine-weighted Halton points starting at sample_index
+	// (advanced by # of samples taken), rotated by offset.
+	// Thread-safe as long as irradiance is not modified.
+	Colorf collectIrradiance(Eigen::Vector3f pos, Eigen::Vector3f normal,
+		uint32_t& sample_index, Eigen::Vector2f offset);
+
+	// Direct sunlight part of collectIrradiance (same scale), by a shadow ray
+	// toward the Sun. The Sun is a delta light, so random rays never find it.
+	Colorf collectSunIrradiance(Eigen::Vector3f pos, Eigen::Vector3f normal);
+private:
+	// Shared with render thread. Only accessed via std::atomic_* functions.
+	std::shared_ptr<const LightingScene> scene_pending;
+	std::shared_ptr<const SkyRadianceMap> sky_map_pending;
+	std::shared_ptr<const LightingResult> result;
+	std::atomic<int> acknowledged_serial;
+
+	// Changes of each updateGeometry call not applied yet. Guarded by
+	// updates_mutex.
+	std::mutex updates_mutex;
+	std::vector<std::vector<LightingChange>> updates_pending;
+
+	// Owned by lighting thread.
+	std::shared_ptr<const LightingScene> scene;
+	std::shared_ptr<const SkyRadianceMap> sky_map;
+	// Latest irradiance of scene->vertices.
+	std::vector<Colorf> irradiance;
+	// Next index in sample sequence of each vertex.
+	std::vector<uint32_t> sample_indices;
+	// # of updates since the vertex was invalidated.
+	std::vector<int> visits;
+	// Running variance of luminance of each update. Infinity when unknown.
+	std::vector<float> variances;
+
+	// Serial of the latest result.
+	int result_serial;
+	// Vertices updated by each result after log_base, as (serial, vertices).
+	// Results list everything after the acknowledged one.
+	std::deque<std::pair<int, std::vector<int>>> update_log;
+	int log_base;
+	// Total # of vertices in update_log.
+	int n_logged;
+	// Vertices updated since the latest result.
+	std::vector<int> updated;
+
+	const LightingMode mode;
+	// Only in RADIOSITY mode.
+	std::unique_ptr<Radiosity> radiosity;
+	bool radiosity_converged;
+
+	int n_threads;
+	const int max_vertices;
+
+	std::atomic<bool> stop;
+	std::thread thread;
+
+	// Workers are kept for the lifetime of Lighting; creating threads per
+	// step would be a large part of each step.
+	std::vector<std::thread> workers;
+	// Below are guarded by job_mutex.
+	std::mutex job_mutex;
+	std::condition_variable job_started;
+	std::condition_variable job_finished;
+	const std::function<void(int)>* job;
+	// Incremented for each job, so that workers run each job once.
+	int job_serial;
+	// # of workers that haven't finished current job.
+	int n_busy_workers;
+	bool stop_workers;
+};
+
+}  // namespace
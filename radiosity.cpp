@@ -0,0 +1,127 @@
+#include "radiosity.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <map>
+#include <thread>
+
+#include "sampling.h"
+
+namespace construct {
+
+Radiosity::Radiosity(std::shared_ptr<const LightingScene> scene, int n_rays, int n_threads) :
+	scene(scene), n_rays(n_rays), n_threads(n_threads) {
+	row_offset.push_back(0);
+	escape_offset.push_back(0);
+	addRows(0);
+}
+
+Radiosity::Radiosity(const Radiosity& base, std::shared_ptr<const LightingScene> scene) :
+	scene(scene), n_rays(base.n_rays), n_threads(base.n_threads),
+	row_offset(base.row_offset), columns(base.columns), factors(base.factors),
+	escape_offset(base.escape_offset), escape_dirs(base.escape_dirs) {
+	assert(base.scene->vertices.size() <= scene->vertices.size());
+	addRows(base.scene->vertices.size());
+}
+
+void Radiosity::addRows(int first) {
+	const int n_vertices = scene->vertices.size();
+	assert(row_offset.size() == first + 1);
+
+	// Rows are built by workers in parallel, and concatenated later.
+	std::vector<std::map<int, float>> rows(n_vertices - first);
+	std::vector<std::vector<Eigen::Vector3f>> escapes(n_vertices - first);
+	auto worker = [&](int i_thread) {
+		for(int v = first + i_thread; v < n_vertices; v += n_threads) {
+			const auto& vertex = scene->vertices[v];
+			for(int i = 0; i < n_rays; i++) {
+				const Eigen::Vector3f dir = sampleCosineHemisphere(
+					sampleHalton2(i, hashToUnitSquare(v)), vertex.normal);
+				const Ray ray(vertex.pos + vertex.normal * 1e-5, dir);
+
+				const Hit hit = scene->bvh.closestHit(ray);
+				if(hit.index < 0) {
+					escapes[v - first].push_back(dir);
+					continue;
+				}
+
+				// Radiance at hit is interpolated from 3 vertices.
+				std::array<int, 3> vertices;
+				Eigen::Vector3f weights;
+				scene->getWeights(hit, vertices, weights);
+				for(int j = 0; j < 3; j++) {
+					rows[v - first][vertices[j]] += weights[j];
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(int i_thread = 1; i_thread < n_threads; i_thread++) {
+		threads.emplace_back(worker, i_thread);
+	}
+	worker(0);
+	for(auto& thread : threads) {
+		thread.join();
+	}
+
+	// Cosine-weighted rays estimate integral / pi. Also divide by 2 to keep the
+	// scale of Lighting::collectIrradiance.
+	const float scale = 1.0f / (2 * n_rays);
+	for(int i = 0; i < rows.size(); i++) {
+		for(const auto& pair : rows[i]) {
+			columns.push_back(pair.first);
+			factors.push_back(pair.second * scale);
+		}
+		row_offset.push_back(columns.size());
+
+		escape_dirs.insert(escape_dirs.end(), escapes[i].begin(), escapes[i].end());
+		escape_offset.push_back(escape_dirs.size());
+	}
+	emission.assign(n_vertices, Colorf(0, 0, 0));
+}
+
+void Radiosity::setSky(const SkyRadianceMap& sky_map) {
+	const Eigen::Vector3f sun_direction = sky_map.getSunDirection();
+	const Colorf sun_irradiance = sky_map.getSunIrradiance();
+
+	for(int v = 0; v < emission.size(); v++) {
+		const auto& vertex = scene->vertices[v];
+
+		Colorf sky(0, 0, 0);
+		for(int i = escape_offset[v]; i < escape_offset[v + 1]; i++) {
+			sky += sky_map.getRadianceAt(escape_dirs[i]);
+		}
+		emission[v] = sky / (2 * n_rays);
+
+		// Same as Lighting::collectSunIrradiance.
+		const float cos = vertex.normal.dot(sun_direction);
+		if(cos > 0) {
+			Ray ray(vertex.pos + vertex.normal * 1e-5, sun_direction);
+			if(!scene->bvh.occluded(ray, std::numeric_limits<float>::infinity())) {
+				emission[v] += sun_irradiance * cos / (2 * pi);
+			}
+		}
+	}
+}
+
+float Radiosity::iterate(std::vector<Colorf>& irradiance) const {
+	assert(irradiance.size() == emission.size());
+
+	float max_change = 0;
+	for(int v = 0; v < emission.size(); v++) {
+		Colorf ir = emission[v];
+		for(int i = row_offset[v]; i < row_offset[v + 1]; i++) {
+			ir += factors[i] * irradiance[columns[i]];
+		}
+		ir = ir.cwiseProduct(scene->vertices[v].brdf);
+
+		max_change = std::max(max_change,
+			std::abs(ir.mean() - irradiance[v].mean()) / (ir.mean() + 1));
+		irradiance[v] = ir;
+	}
+	return max_change;
+}
+
+}  // namespace
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+
+#include "lighting.h"
+#include "sky.h"
+#include "util.h"
+
+namespace construct {
+
+// Radiosity over welded vertices of a LightingScene.
+//
+// Same equation as Lighting's gatherer,
+//   irradiance(v) = brdf(v) * (sky(v) + sun(v) + sum_u F(v, u) * irradiance(u)),
+// but F (form factors incl. visibility) is estimated only once by casting
+// rays, and stored as a sparse matrix. After that, bounces are solved by
+// Gauss-Seidel iterations without any ray casting.
+//
+// This works because the scene is static and Lambertian; any change of
+// geometry requires a new Radiosity (subdivision can reuse the old rows).
+class Radiosity {
+public:
+	// n_rays: # of rays per vertex used to estimate form factors.
+	Radiosity(std::shared_ptr<const LightingScene> scene, int n_rays, int n_threads);
+
+	// For scene that only appended vertices to scene of base (subdivision).
+	// Only new vertices cast rays; rows of old vertices are kept, since
+	// vertices they refer to still exist (just coarser than possible).
+	Radiosity(const Radiosity& base, std::shared_ptr<const LightingScene> scene);
+
+	// Recalculate light from sky & sun. (F is kept)
+	void setSky(const SkyRadianceMap& sky_map);
+
+	// Update irradiance (of scene->vertices) by one Gauss-Seidel sweep.
+	// Return max change of luminance relative to luminance (+1).
+	float iterate(std::vector<Colorf>& irradiance) const;
+private:
+	// Cast rays from vertices [first, # of vertices) and append their rows.
+	void addRows(int first);
+private:
+	std::shared_ptr<const LightingScene> scene;
+	int n_rays;
+	int n_threads;
+
+	// F in CSR format. Row v is [row_offset[v], row_offset[v + 1]).
+	std::vector<int> row_offset;
+	std::vector<int> columns;
+	std::vector<float> factors;
+
+	// Directions of rays that escaped the scene, for setSky.
+	// Same format as F.
+	std::vector<int> escape_offset;
+	std::vector<Eigen::Vector3f> escape_dirs;
+
+	// sky(v) + sun(v)
+	std::vector<Colorf> emission;
+};
+
+}  // namespace
@@ -0,0 +1,100 @@
+#include "sampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "util.h"
+
+namespace construct {
+
+Eigen::Vector3f sampleCosineHemisphere(Eigen::Vector2f u, Eigen::Vector3f normal) {
+	// Uniform on unit disk, projected to hemisphere (Malley's method).
+	const float r = std::sqrt(u.x());
+	const float phi = 2 * pi * u.y();
+	const float z = std::sqrt(std::max(0.0f, 1 - u.x()));
+
+	// Orthonormal basis around normal, without branch on normal.z
+	// (Duff et al. 2017).
+	const float sign = std::copysign(1.0f, normal.z());
+	const float a = -1 / (sign + normal.z());
+	const float b = normal.x() * normal.y() * a;
+	const Eigen::Vector3f tangent(1 + sign * normal.x() * normal.x() * a, sign * b, -sign * normal.x());
+	const Eigen::Vector3f bitangent(b, sign + normal.y() * normal.y() * a, -normal.y());
+
+	return (r * std::cos(phi)) * tangent + (r * std::sin(phi)) * bitangent + z * normal;
+}
+
+float radicalInverse(int base, uint32_t index) {
+	const float base_inv = 1.0f / base;
+	float scale = base_inv;
+	float result = 0;
+	while(index > 0) {
+		result += (index % base) * scale;
+		index /= base;
+		scale *= base_inv;
+	}
+	// Rounding can make it 1.
+	return std::min(result, 1 - 1e-7f);
+}
+
+Eigen::Vector2f sampleHalton2(uint32_t index, Eigen::Vector2f offset) {
+	Eigen::Vector2f u(radicalInverse(2, index), radicalInverse(3, index));
+	u += offset;
+	for(int i = 0; i < 2; i++) {
+		if(u[i] >= 1) {
+			u[i] -= 1;
+		}
+	}
+	return u;
+}
+
+Eigen::Vector2f hashToUnitSquare(uint32_t seed) {
+	// Two rounds of integer hash (lowbias32).
+	auto hash = [](uint32_t x) {
+		x ^= x >> 16;
+		x *= 0x7feb352d;
+		x ^= x >> 15;
+		x *= 0x846ca68b;
+		x ^= x >> 16;
+		return x;
+	};
+	const uint32_t h0 = hash(seed);
+	const uint32_t h1 = hash(h0);
+	// Use upper 24 bits, which are exact in float.
+	return Eigen::Vector2f(h0 >> 8, h1 >> 8) / static_cast<float>(1 << 24);
+}
+
+
+SampleStats::SampleStats() : count(0), mean(0), m2(0) {
+}
+
+void SampleStats::add(float x) {
+	count++;
+	const float delta = x - mean;
+	mean += delta / count;
+	m2 += delta * (x - mean);
+}
+
+int SampleStats::getCount() const {
+	return count;
+}
+
+float SampleStats::getMean() const {
+	return mean;
+}
+
+float SampleStats::getVariance() const {
+	if(count < 2) {
+		return 0;
+	}
+	return m2 / (count - 1);
+}
+
+float SampleStats::getError() const {
+	if(count == 0) {
+		return 0;
+	}
+	return std::sqrt(getVariance() / count);
+}
+
+}  // namespace
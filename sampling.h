@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+#include <eigen3/Eigen/Dense>
+
+namespace construct {
+
+// Return direction in hemisphere around normal, with pdf = cos / pi.
+// u: uniform in [0, 1)^2
+Eigen::Vector3f sampleCosineHemisphere(Eigen::Vector2f u, Eigen::Vector3f normal);
+
+// Van der Corput sequence in given base. Return value is in [0, 1).
+float radicalInverse(int base, uint32_t index);
+
+// index-th point of 2D Halton sequence (base 2, 3), shifted by offset (mod 1)
+// so that each user of the sequence (e.g. vertex) sees a different pattern
+// (Cranley-Patterson rotation).
+Eigen::Vector2f sampleHalton2(uint32_t index, Eigen::Vector2f offset);
+
+// Pseudo-random point in [0, 1)^2 derived from seed. Useful as offset of
+// sampleHalton2.
+Eigen::Vector2f hashToUnitSquare(uint32_t seed);
+
+
+// Running mean & variance of samples (Welford's method).
+class SampleStats {
+public:
+	SampleStats();
+
+	void add(float x);
+
+	int getCount() const;
+	float getMean() const;
+	// Unbiased sample variance. 0 when count < 2.
+	float getVariance() const;
+	// Standard error of mean.
+	float getError() const;
+private:
+	int count;
+	float mean;
+	float m2;
+};
+
+}  // namespace
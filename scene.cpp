@@ -1,9 +1,77 @@
 #include "scene.h"
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+#include "bake.h"
+
 namespace construct {
 
+// Lighting mesh is subdivided until it has this many vertices.
+const int max_lighting_vertices = 200000;
+
+// Sky (sky_map & texture) is rebuilt at most once per this many steps.
+// Rebuilding blocks the render thread (SkyRadianceMap & 512x256 texture).
+const int sky_update_interval = 30;
+
+// Scene::render draws everything for both eyes.
+const int n_eyes = 2;
+
+// Call upload(first, count) for each span of [0, n) containing changed(i).
+// Spans separated by less than max_gap are merged, to save calls.
+template<class ChangedFn, class UploadFn>
+void forEachChangedSpan(int n, ChangedFn changed, UploadFn upload) {
+	const int max_gap = 16;
+	for(int i = 0; i < n; ) {
+		if(!changed(i)) {
+			i++;
+			continue;
+		}
+
+		int last = i;
+		for(int j = i + 1; j < n && j <= last + max_gap; j++) {
+			if(changed(j)) {
+				last = j;
+			}
+		}
+		upload(i, last + 1 - i);
+		i = last + 1;
+	}
+}
+
+// Call upload(first, count) for spans covering sorted indices. Same merging
+// as forEachChangedSpan, without visiting unchanged ones.
+template<class UploadFn>
+void forEachSpan(const std::vector<int>& indices, UploadFn upload) {
+	const int max_gap = 16;
+	for(int i = 0; i < indices.size(); ) {
+		int j = i + 1;
+		while(j < indices.size() && indices[j] <= indices[j - 1] + max_gap) {
+			j++;
+		}
+		upload(indices[i], indices[j - 1] + 1 - indices[i]);
+		i = j;
+	}
+}
+
+UITransform::UITransform() : dirty(true), trans(Transform3f::Identity()) {
+}
+
+void UITransform::set(const Transform3f& trans) {
+	if(trans.matrix() != this->trans.matrix()) {
+		dirty = true;
+	}
+	this->trans = trans;
+}
+
+const Transform3f& UITransform::get() const {
+	return trans;
+}
+
+
 Object::Object(Scene& scene, ObjectId id) : scene(scene), use_blend(false),
-	local_to_world(Transform3f::Identity()), id(id) {
+	id(id) {
 }
 
 void Object::addMessage(Json::Value value) {
@@ -21,7 +89,7 @@ boost::optional<Json::Value> Object::getMessage() {
 }
 
 void Object::setLocalToWorld(Transform3f trans) {
-	local_to_world = trans;
+	local_to_world.set(trans);
 }
 
 Transform3f Object::getLocalToWorld() {
@@ -29,7 +97,7 @@ Transform3f Object::getLocalToWorld() {
 		throw "Non UI component doesn't have tranform";
 	}
 
-	return local_to_world;
+	return local_to_world.get();
 }
 
 
@@ -40,11 +108,239 @@ void NativeScript::step(float dt, Object& object) {
 }
 
 
+TriangleSlots::TriangleSlots() : n_slots(0) {
+}
+
+int TriangleSlots::allocate(int count) {
+	for(auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+		if(it->second < count) {
+			continue;
+		}
+
+		const int first = it->first;
+		const int rest = it->second - count;
+		free_ranges.erase(it);
+		if(rest > 0) {
+			free_ranges[first + count] = rest;
+		}
+		return first;
+	}
+
+	const int first = n_slots;
+	n_slots += count;
+	return first;
+}
+
+void TriangleSlots::free(int first, int count) {
+	if(count == 0) {
+		return;
+	}
+
+	auto it = free_ranges.insert(std::make_pair(first, count)).first;
+
+	// Merge with the next one.
+	auto it_next = std::next(it);
+	if(it_next != free_ranges.end() && it->first + it->second == it_next->first) {
+		it->second += it_next->second;
+		free_ranges.erase(it_next);
+	}
+
+	// Merge with the previous one.
+	if(it != free_ranges.begin()) {
+		auto it_prev = std::prev(it);
+		if(it_prev->first + it_prev->second == it->first) {
+			it_prev->second += it->second;
+			free_ranges.erase(it);
+		}
+	}
+}
+
+int TriangleSlots::size() const {
+	return n_slots;
+}
+
+
+// Extract local-space tris from PosUV format.
+std::vector<Triangle> extractUITriangles(ObjectId id, const std::vector<float>& data) {
+	std::vector<Triangle> tris;
+	assert(data.size() % (5 * 3) == 0);
+	for(int i = 0; i < data.size() / (5 * 3); i++) {
+		std::array<Eigen::Vector3f, 3> vertex;
+		std::array<Eigen::Vector2f, 3> uvs;
+		for(int j = 0; j < 3; j++) {
+			vertex[j] = Eigen::Vector3f(
+				data[5 * (3 * i + j) + 0],
+				data[5 * (3 * i + j) + 1],
+				data[5 * (3 * i + j) + 2]);
+
+			uvs[j] = Eigen::Vector2f(
+				data[5 * (3 * i + j) + 3],
+				data[5 * (3 * i + j) + 4]);
+		}
+		Triangle tri(vertex[0], vertex[1], vertex[2]);
+		tri.attribute = id;
+		tri.setUV(uvs[0], uvs[1], uvs[2]);
+		tris.push_back(tri);
+	}
+	return tris;
+}
+
+UIGeometry::UIGeometry() {
+}
+
+void UIGeometry::add(ObjectId id, std::shared_ptr<const Geometry> geometry,
+	const std::vector<float>& pos_uv, UITransform& local_to_world) {
+	Item item;
+	item.id = id;
+	item.geometry = geometry;
+	item.pos_uv = &pos_uv;
+	item.local_to_world = &local_to_world;
+	items.push_back(std::move(item));
+}
+
+UIUpdate UIGeometry::update() {
+	bool structure_changed = (items.size() != caches.size());
+	for(const auto& item : items) {
+		auto it = caches.find(item.id);
+		if(it == caches.end() || it->second.geometry != item.geometry) {
+			structure_changed = true;
+			break;
+		}
+	}
+
+	UIUpdate result = UI_UPDATE_NONE;
+	if(structure_changed) {
+		std::map<ObjectId, UITriangles> caches_new;
+		tris.clear();
+		for(const auto& item : items) {
+			UITriangles cache;
+			auto it = caches.find(item.id);
+			if(it != caches.end() && it->second.geometry == item.geometry) {
+				cache = std::move(it->second);
+			} else {
+				cache.geometry = item.geometry;
+				cache.tris_local = extractUITriangles(item.id, *item.pos_uv);
+			}
+			cache.first = tris.size();
+
+			const auto& trans = item.local_to_world->get();
+			for(const auto& tri : cache.tris_local) {
+				tris.push_back(tri.transformed(trans));
+			}
+			item.local_to_world->dirty = false;
+
+			caches_new[item.id] = std::move(cache);
+		}
+		caches.swap(caches_new);
+		bvh.build(tris);
+		result = UI_UPDATE_BUILD;
+	} else {
+		// Only re-transform moved objects.
+		for(const auto& item : items) {
+			if(!item.local_to_world->dirty) {
+				continue;
+			}
+
+			const auto& cache = caches[item.id];
+			const auto& trans = item.local_to_world->get();
+			for(int i = 0; i < cache.tris_local.size(); i++) {
+				tris[cache.first + i] = cache.tris_local[i].transformed(trans);
+			}
+			item.local_to_world->dirty = false;
+			result = UI_UPDATE_REFIT;
+		}
+		if(result == UI_UPDATE_REFIT) {
+			bvh.refit(tris);
+		}
+	}
+	items.clear();
+	return result;
+}
+
+boost::optional<Intersection> UIGeometry::intersect(Ray ray) const {
+	return bvh.intersect(tris, ray);
+}
+
+
+IrradianceTexels::IrradianceTexels() {
+	clear();
+}
+
+void IrradianceTexels::clear() {
+	offsets.assign(1, 0);
+	vertices.clear();
+	weights.clear();
+	vertex_offsets.clear();
+	vertex_texels.clear();
+}
+
+void IrradianceTexels::addTerm(int vertex, float weight) {
+	vertices.push_back(vertex);
+	weights.push_back(weight);
+}
+
+void IrradianceTexels::endTexel() {
+	offsets.push_back(vertices.size());
+}
+
+void IrradianceTexels::buildIndex(int n_vertices) {
+	// Counting sort of (vertex, texel) by vertex.
+	vertex_offsets.assign(n_vertices + 1, 0);
+	for(int vertex : vertices) {
+		vertex_offsets[vertex + 1]++;
+	}
+	std::partial_sum(vertex_offsets.begin(), vertex_offsets.end(), vertex_offsets.begin());
+
+	std::vector<int> next(vertex_offsets.begin(), vertex_offsets.end() - 1);
+	vertex_texels.resize(vertices.size());
+	for(int texel = 0; texel < size(); texel++) {
+		for(int k = offsets[texel]; k < offsets[texel + 1]; k++) {
+			vertex_texels[next[vertices[k]]++] = texel;
+		}
+	}
+}
+
+int IrradianceTexels::size() const {
+	return offsets.size() - 1;
+}
+
+Colorf IrradianceTexels::getIrradiance(int texel, const std::vector<Colorf>& irradiance) const {
+	Colorf ir(0, 0, 0);
+	for(int k = offsets[texel]; k < offsets[texel + 1]; k++) {
+		ir += weights[k] * irradiance[vertices[k]];
+	}
+	return ir;
+}
+
+void IrradianceTexels::appendTexels(int vertex, std::vector<int>& texels) const {
+	texels.insert(texels.end(),
+		vertex_texels.begin() + vertex_offsets[vertex],
+		vertex_texels.begin() + vertex_offsets[vertex + 1]);
+}
+
+
 // For diffuse-like surface, luminance = candela / 2pi
 // overcast sky = (200, 200, 220)
-Scene::Scene() : new_id(0), native_script_counter(0), lighting_counter(0) {
+Scene::Scene(int n_lighting_threads, LightingMode lighting_mode) :
+	sky_changed(false), steps_since_sky_update(sky_update_interval),
+	n_lighting_updates(0),
+	new_id(0), native_script_counter(0) {
+	sky_map = std::make_shared<SkyRadianceMap>(sky);
+	lighting.reset(new Lighting(sky_map, n_lighting_threads, lighting_mode,
+		max_lighting_vertices));
+	irradiance_buffer = TextureBuffer::create();
+
 	standard_shader = Shader::create("gpu/base.vs", "gpu/base.fs");
 	texture_shader = Shader::create("gpu/tex.vs", "gpu/tex.fs");
+	instance_shader = Shader::create("gpu/instance.vs", "gpu/base.fs");
+
+	// Everything reads its texture from slot 0.
+	standard_shader->use();
+	standard_shader->setUniform("irradiance", 0);
+	texture_shader->use();
+	texture_shader->setUniform("texture", 0);
+	instance_shader->use();
+	instance_shader->setUniform("irradiance", 0);
 }
 
 ObjectId Scene::add() {
@@ -92,25 +388,22 @@ boost::optional<Intersection>
 }
 
 boost::optional<Intersection> Scene::intersectUI(Ray ray) {
-	boost::optional<Intersection> isect_nearest;
-	for(auto& tri : tris_ui) {
-		auto isect = tri.intersect(ray);
-		if(isect && (!isect_nearest || isect->t < isect_nearest->t)) {
-			isect_nearest = isect;
-		}
-	}
-	return isect_nearest;
+	return ui_geometry.intersect(ray);
 }
 
 boost::optional<Intersection> Scene::intersect(Ray ray) {
-	boost::optional<Intersection> isect_nearest;
-	for(auto& tri : tris) {
-		auto isect = tri.intersect(ray);
-		if(isect && (!isect_nearest || isect->t < isect_nearest->t)) {
-			isect_nearest = isect;
-		}
+	// tris might be ahead of lighting; use the geometry of the result.
+	if(!lighting_result) {
+		return boost::optional<Intersection>();
+	}
+	const LightingScene& scene = *lighting_result->scene;
+	const Hit hit = scene.bvh.closestHit(ray);
+	if(hit.index < 0) {
+		return boost::optional<Intersection>();
 	}
-	return isect_nearest;
+	Intersection isect = scene.tris[hit.index].createIntersection(ray, hit);
+	isect.radiance = lighting_result->getRadiance(hit);
+	return isect;
 }
 
 void Scene::step() {
@@ -131,156 +424,407 @@ void Scene::step() {
 	}
 	deletion.clear();
 
-	//updateGeometry();
+	updateGeometry();
 	updateUIGeometry();
-	updateLighting();
 	updateIrradiance();
+	updateSky();
+}
+
+void Scene::notifyGeometryChange(ObjectId id) {
+	auto it = static_ranges.find(id);
+	if(it != static_ranges.end()) {
+		it->second.dirty = true;
+	}
 }
 
 void Scene::updateGeometry() {
-	tris.clear();
-	tris.reserve(objects.size());
+	std::vector<LightingChange> changes;
+
+	// Remove objects that are deleted or not STATIC anymore.
+	for(auto it = static_ranges.begin(); it != static_ranges.end(); ) {
+		auto it_object = objects.find(it->first);
+		if(it_object != objects.end() && it_object->second->type == ObjectType::STATIC) {
+			++it;
+			continue;
+		}
+
+		LightingChange change;
+		change.id = it->first;
+		change.first_old = it->second.first;
+		change.count_old = it->second.count;
+		change.removed = true;
+		changes.push_back(std::move(change));
+		slots.free(it->second.first, it->second.count);
+		it = static_ranges.erase(it);
+	}
+
+	// Add new or changed objects.
 	for(auto& pair : objects) {
-		if(pair.second->type != ObjectType::STATIC) {
+		Object& object = *pair.second;
+		if(object.type != ObjectType::STATIC) {
+			continue;
+		}
+		auto it = static_ranges.find(pair.first);
+		if(it != static_ranges.end() && !it->second.dirty &&
+			it->second.geometry == object.geometry) {
 			continue;
 		}
 
-		// Extract tris from PosCol format.
-		auto& data = pair.second->geometry->getData();
-		assert(data.size() % (6 * 3) == 0);
-		for(int i = 0; i < data.size() / (6 * 3); i++) {
+		// Extract tris from PosCol format, or Pos format for instances.
+		LightingChange change;
+		change.id = object.id;
+		const auto& instance = object.instance;
+		auto& data = object.geometry->getData();
+		const int columns = instance ? 3 : 6;
+		assert(data.size() % (columns * 3) == 0);
+		for(int i = 0; i < data.size() / (columns * 3); i++) {
 			std::array<Eigen::Vector3f, 3> vertex;
 			for(int j = 0; j < 3; j++) {
 				vertex[j] = Eigen::Vector3f(
-					data[6 * (3 * i + j) + 0],
-					data[6 * (3 * i + j) + 1],
-					data[6 * (3 * i + j) + 2]);
+					data[columns * (3 * i + j) + 0],
+					data[columns * (3 * i + j) + 1],
+					data[columns * (3 * i + j) + 2]);
+				if(instance) {
+					vertex[j] = instance->local_to_world * vertex[j];
+				}
 			}
 			Triangle tri(vertex[0], vertex[1], vertex[2]);
-			tri.attribute = pair.first;
-			tris.push_back(tri);
+			tri.attribute = object.id;
+			change.tris.push_back(tri);
+		}
+
+		// Reuse current range when possible.
+		TriangleRange range;
+		if(it != static_ranges.end()) {
+			change.first_old = it->second.first;
+			change.count_old = it->second.count;
+		}
+		if(it != static_ranges.end() && it->second.count == change.tris.size()) {
+			range = it->second;
+		} else {
+			if(it != static_ranges.end()) {
+				slots.free(it->second.first, it->second.count);
+			}
+			range.first = allocateTriangles(change.tris.size());
+			range.count = change.tris.size();
 		}
+		range.geometry = object.geometry;
+		range.dirty = false;
+		// Old faces don't fit new geometry. Batched until lighting catches up.
+		range.lit_geometry.reset();
+		static_ranges[object.id] = range;
+
+		change.first = range.first;
+		std::copy(change.tris.begin(), change.tris.end(), tris.begin() + range.first);
+		changes.push_back(std::move(change));
+	}
+	if(changes.empty()) {
+		return;
 	}
+
+	// Welding and BVH building happen in the lighting thread.
+	lighting->updateGeometry(std::move(changes));
+	n_lighting_updates++;
+	updateStaticBatch();
+}
+
+int Scene::allocateTriangles(int count) {
+	const int first = slots.allocate(count);
+	tris.resize(slots.size(),
+		Triangle(Eigen::Vector3f::Zero(), Eigen::Vector3f::UnitX(), Eigen::Vector3f::UnitY()));
+	return first;
 }
 
 void Scene::updateUIGeometry() {
-	tris_ui.clear();
 	for(auto& pair : objects) {
-		if(pair.second->type != ObjectType::UI) {
+		Object& object = *pair.second;
+		if(object.type != ObjectType::UI) {
 			continue;
 		}
+		ui_geometry.add(object.id, object.geometry, object.geometry->getData(),
+			object.local_to_world);
+	}
+	ui_geometry.update();
+}
 
-		auto trans = pair.second->getLocalToWorld();
+void Scene::updateIrradiance() {
+	// Never wait for lighting; just take whatever is latest. Until lighting
+	// applies all geometry updates, its tris are laid out differently.
+	auto result = lighting->getResult();
+	if(!result || result == lighting_result ||
+		result->scene->n_updates != n_lighting_updates) {
+		return;
+	}
 
-		// Extract tris from PosUV format.
-		auto& data = pair.second->geometry->getData();
-		assert(data.size() % (5 * 3) == 0);
-		for(int i = 0; i < data.size() / (5 * 3); i++) {
-			std::array<Eigen::Vector3f, 3> vertex;
-			std::array<Eigen::Vector2f, 3> uvs;
-			for(int j = 0; j < 3; j++) {
-				vertex[j] = trans * Eigen::Vector3f(
-					data[5 * (3 * i + j) + 0],
-					data[5 * (3 * i + j) + 1],
-					data[5 * (3 * i + j) + 2]);
-
-				uvs[j] = Eigen::Vector2f(
-					data[5 * (3 * i + j) + 3],
-					data[5 * (3 * i + j) + 4]);
-			}
-			Triangle tri(vertex[0], vertex[1], vertex[2]);
-			tri.attribute = pair.first;
-			tri.setUV(uvs[0], uvs[1], uvs[2]);
-			tris_ui.push_back(tri);
-		}
+	// Results of the same scene list vertices updated since base_serial.
+	const bool incremental = lighting_result && lighting_result->scene == result->scene &&
+		result->base_serial <= lighting_result->serial;
+	lighting_result = result;
+	lighting->acknowledgeResult(result->serial);
+	if(incremental) {
+		updateIrradianceBuffer(result->updated);
+		return;
+	}
+
+	// Vertex positions don't depend on irradiance; only ranges that started
+	// (or stopped) having lit_geometry move between batches.
+	if(rebuildIrradianceBuffer()) {
+		updateStaticBatch();
 	}
 }
 
-void Scene::updateLighting() {
-	if(tris.empty()) {
-		return;
+bool Scene::rebuildIrradianceBuffer() {
+	const LightingScene& scene = *lighting_result->scene;
+	assert(scene.tris.size() == tris.size());
+	assert(lighting_result->irradiance.size() == scene.vertices.size());
+
+	// Texel 3i + j is corner j of tris[i].
+	texel_sources.clear();
+	for(int i = 0; i < tris.size(); i++) {
+		for(int j = 0; j < 3; j++) {
+			if(scene.corners[i][j] >= 0) {
+				texel_sources.addTerm(scene.corners[i][j], 1);
+			}
+			texel_sources.endTexel();
+		}
 	}
-	
-	// TODO: use proper multi-threading.
-	const int max_tris = 5;
-	
-	// assuming more than 5 samples.
-	const float blend_rate = 0.5;
 
-	for(int i = 0; i < max_tris; i++) {
-		auto& tri = tris[lighting_counter];
+	// Subdivided objects get their own texels after tris. Faces only change
+	// with the scene, so this is the only place to build lit_geometry.
+	bool lit_changed = false;
+	for(auto& pair : static_ranges) {
+		TriangleRange& range = pair.second;
 
-		tri.ir0 *= (1 - blend_rate);
-		tri.ir1 *= (1 - blend_rate);
-		tri.ir2 *= (1 - blend_rate);
+		bool subdivided = false;
+		for(int i = range.first; i < range.first + range.count; i++) {
+			subdivided |= scene.faces[i].children >= 0;
+		}
+		if(!subdivided) {
+			lit_changed |= static_cast<bool>(range.lit_geometry);
+			range.lit_geometry.reset();
+			continue;
+		}
 
-		tri.ir0 += blend_rate * collectIrradiance(tri.getVertexPos(0), tri.getNormal())
-			.cwiseProduct(tri.brdf());
-		tri.ir1 += blend_rate * collectIrradiance(tri.getVertexPos(1), tri.getNormal())
-			.cwiseProduct(tri.brdf());
-		tri.ir2 += blend_rate * collectIrradiance(tri.getVertexPos(2), tri.getNormal())
-			.cwiseProduct(tri.brdf());
+		range.lit_offset = texel_sources.size();
+		std::vector<float> pos;
+		auto add_vertex = [&](const Eigen::Vector3f& p) {
+			pos.insert(pos.end(), {p.x(), p.y(), p.z()});
+			texel_sources.endTexel();
+		};
+		auto add_point = [&](const LightingPoint& point, float weight) {
+			texel_sources.addTerm(point.v0, weight * (1 - point.t));
+			if(point.t > 0) {
+				texel_sources.addTerm(point.v1, weight * point.t);
+			}
+		};
+		for(const auto& polygon : scene.getLeafPolygons(range.first, range.count)) {
+			std::vector<Eigen::Vector3f> positions;
+			for(const auto& point : polygon) {
+				const auto& vertex0 = scene.vertices[point.v0];
+				const auto& vertex1 = scene.vertices[point.v1];
+				positions.push_back(vertex0.pos * (1 - point.t) + vertex1.pos * point.t);
+			}
+			if(polygon.size() == 3) {
+				for(int j = 0; j < 3; j++) {
+					add_point(polygon[j], 1);
+					add_vertex(positions[j]);
+				}
+				continue;
+			}
 
-		lighting_counter += 1;
-		lighting_counter %= tris.size();
+			// Fan from the center, so that every point on the boundary
+			// is a vertex of the mesh.
+			Eigen::Vector3f p_center = Eigen::Vector3f::Zero();
+			for(int j = 0; j < polygon.size(); j++) {
+				p_center += positions[j] / polygon.size();
+			}
+			for(int j = 0; j < polygon.size(); j++) {
+				const int k = (j + 1) % polygon.size();
+				for(const auto& point : polygon) {
+					add_point(point, 1.0f / polygon.size());
+				}
+				add_vertex(p_center);
+				add_point(polygon[j], 1);
+				add_vertex(positions[j]);
+				add_point(polygon[k], 1);
+				add_vertex(positions[k]);
+			}
+		}
+
+		if(!range.lit_geometry || range.lit_geometry->getData() != pos) {
+			lit_changed = true;
+			range.lit_geometry = Geometry::createPos(pos.size() / 3, pos.data());
+		}
 	}
+	texel_sources.buildIndex(scene.vertices.size());
 
-	// tris = concat(geometry).
-	// Since most objects are cuboid, same face should exist just after
-	// current tri.
-	//
-	// TODO: lift this assumption.
-	for(int i = 0; i < tris.size() - 1; i++) {
-		if((tris[i].getVertexPos(1) - tris[i + 1].getVertexPos(2)).norm() < 1e-3 &&
-			(tris[i].getNormal() - tris[i + 1].getNormal()).norm() < 1e-3) {
-			// (i, 1) - (i + 1, 2)
-			// (i, 2) - (i + 1, 1)
-			const Colorf vx = (tris[i].ir1 + tris[i + 1].ir2) / 2;
-			const Colorf vy = (tris[i].ir2 + tris[i + 1].ir1) / 2;
+	const bool resized = irradiance_texels.size() != 4 * texel_sources.size();
+	irradiance_texels.resize(4 * texel_sources.size(), 0);
+	std::vector<int> changed;
+	for(int i = 0; i < texel_sources.size(); i++) {
+		if(updateTexel(i)) {
+			changed.push_back(i);
+		}
+	}
+	if(resized) {
+		irradiance_buffer->setData(irradiance_texels);
+	} else {
+		forEachSpan(changed, [&](int first, int count) {
+			irradiance_buffer->updateData(first, count, &irradiance_texels[4 * first]);
+		});
+	}
+	return lit_changed;
+}
+
+void Scene::updateIrradianceBuffer(const std::vector<int>& vertices) {
+	std::vector<int> texels;
+	for(int vertex : vertices) {
+		texel_sources.appendTexels(vertex, texels);
+	}
+	std::sort(texels.begin(), texels.end());
+	texels.erase(std::unique(texels.begin(), texels.end()), texels.end());
 
-			tris[i].ir1 = vx;
-			tris[i + 1].ir2 = vx;
-			tris[i].ir2 = vy;
-			tris[i + 1].ir1 = vy;
+	std::vector<int> changed;
+	for(int texel : texels) {
+		if(updateTexel(texel)) {
+			changed.push_back(texel);
 		}
 	}
+	forEachSpan(changed, [&](int first, int count) {
+		irradiance_buffer->updateData(first, count, &irradiance_texels[4 * first]);
+	});
 }
 
-void Scene::updateIrradiance() {
-	auto it = tris.begin();
+bool Scene::updateTexel(int texel) {
+	const Colorf ir = texel_sources.getIrradiance(texel, lighting_result->irradiance);
+	if(texel < 3 * tris.size()) {
+		tris[texel / 3].setIrradiance(texel % 3, ir);
+	}
 
-	for(auto& pair : objects) {
-		auto& object = pair.second;
+	const std::array<uint16_t, 4> halves = {
+		floatToHalf(ir[0]), floatToHalf(ir[1]), floatToHalf(ir[2]), 0};
+	uint16_t* dest = &irradiance_texels[4 * texel];
+	if(std::equal(halves.begin(), halves.end(), dest)) {
+		return false;
+	}
+	std::copy(halves.begin(), halves.end(), dest);
+	return true;
+}
 
-		if(!object->texture) {
-			auto& data = object->geometry->getData();
+bool Scene::isBatched(const Object& object, const TriangleRange& range) const {
+	return !object.use_blend && !range.lit_geometry;
+}
 
-			// assume pos + col format
-			for(int i = 0; i < data.size() / (6 * 3); i++) {
-				for(int j = 0; j < 3; j++) {
-					Colorf ir;
-					if(j == 0) {
-						ir = it->ir0;
-					} else if(j == 1) {
-						ir = it->ir1;
-					} else {
-						ir = it->ir2;
-					}
-
-					data[6 * (3 * i + j) + 3] = ir[0];
-					data[6 * (3 * i + j) + 4] = ir[1];
-					data[6 * (3 * i + j) + 5] = ir[2];
-				}
+void Scene::updateStaticBatch() {
+	// Slots of unbatched objects (and unused slots) are degenerate.
+	std::vector<float> data;
+	std::map<std::shared_ptr<Geometry>, std::vector<float>> instance_data;
+	for(const auto& pair : static_ranges) {
+		const Object& object = *objects[pair.first];
+		const TriangleRange& range = pair.second;
+		if(!isBatched(object, range)) {
+			continue;
+		}
+
+		if(object.instance) {
+			Eigen::Matrix<float, 3, 4, Eigen::RowMajor> m =
+				object.instance->local_to_world.matrix().topRows(3);
+			auto& rows = instance_data[object.geometry];
+			rows.insert(rows.end(), m.data(), m.data() + m.size());
+			rows.push_back(3 * range.first);
+			continue;
+		}
 
-				it++;
+		data.resize(std::max<int>(data.size(), 3 * 3 * (range.first + range.count)), 0);
+		for(int i = range.first; i < range.first + range.count; i++) {
+			for(int j = 0; j < 3; j++) {
+				const Eigen::Vector3f pos = tris[i].getVertexPos(j);
+				std::copy(pos.data(), pos.data() + 3, &data[3 * (3 * i + j)]);
 			}
+		}
+	}
 
-			object->geometry->notifyDataChange();
+	// Instances are few compared to vertices; upload whole rows when changed.
+	std::map<std::shared_ptr<Geometry>, std::shared_ptr<InstanceArray>> batches_new;
+	for(auto& pair : instance_data) {
+		auto it = instance_batches.find(pair.first);
+		auto instances = (it != instance_batches.end()) ?
+			it->second : InstanceArray::create({4, 4, 4, 1});
+		if(instances->getData() != pair.second) {
+			instances->getData().swap(pair.second);
+			instances->notifyDataChange();
 		}
+		batches_new[pair.first] = instances;
+	}
+	instance_batches.swap(batches_new);
+
+	if(data.empty()) {
+		static_batch.reset();
+		return;
+	}
+	if(!static_batch || static_batch->getData().size() != data.size()) {
+		static_batch = Geometry::createPos(data.size() / 3, data.data());
+		return;
 	}
 
-	// # of tris and total Geometry must match
-	assert(it == tris.end());
+	auto& data_old = static_batch->getData();
+	forEachChangedSpan(data.size() / 3,
+		[&](int i) {
+			return !std::equal(&data[3 * i], &data[3 * i + 3], &data_old[3 * i]);
+		},
+		[&](int first, int count) {
+			std::copy(&data[3 * first], &data[3 * (first + count)], &data_old[3 * first]);
+			static_batch->notifyDataChange(first, count);
+		});
+}
+
+void Scene::saveIrradiance(const std::string& path) {
+	std::vector<std::pair<int, int>> ranges;
+	for(const auto& pair : static_ranges) {
+		ranges.emplace_back(pair.second.first, pair.second.count);
+	}
+
+	// Convergence is only known when lighting_result has the same layout.
+	std::vector<bool> converged(3 * tris.size(), false);
+	if(lighting_result && lighting_result->scene->n_updates == n_lighting_updates) {
+		const LightingScene& scene = *lighting_result->scene;
+		for(int i = 0; i < tris.size(); i++) {
+			for(int j = 0; j < 3; j++) {
+				const int vertex = scene.corners[i][j];
+				converged[3 * i + j] = vertex >= 0 && lighting_result->vertex_converged[vertex];
+			}
+		}
+	}
+	IrradianceBake::save(path, sky.getParameterHash(), tris, converged, ranges);
+}
+
+void Scene::loadIrradiance(const std::string& path) {
+	updateGeometry();
+
+	// Lighting under another sky (e.g. the Sun moved) is useless.
+	IrradianceBake bake(path, sky.getParameterHash());
+	std::vector<LightingChange> changes;
+	bool loaded = false;
+	for(const auto& pair : static_ranges) {
+		const TriangleRange& range = pair.second;
+
+		// Same slots and geometry either way. Groups missing in the bake are
+		// sent as changed, so that baked vertices that see them are relit.
+		LightingChange change;
+		change.id = pair.first;
+		change.first_old = range.first;
+		change.count_old = range.count;
+		change.first = range.first;
+		change.baked = bake.apply(tris, range.first, range.count, change.converged);
+		change.tris.assign(tris.begin() + range.first, tris.begin() + range.first + range.count);
+		loaded |= change.baked;
+		changes.push_back(std::move(change));
+	}
+	if(!loaded) {
+		return;
+	}
+	lighting->updateGeometry(std::move(changes));
+	n_lighting_updates++;
 }
 
 Colorf Scene::getRadiance(Ray ray) {
@@ -288,86 +832,252 @@ Colorf Scene::getRadiance(Ray ray) {
 
 	return isect ?
 		isect->radiance :
-		sky.getRadianceAt(ray.dir);
+		sky_map->getRadianceAt(ray.dir);
 }
 
-Colorf Scene::collectIrradiance(Eigen::Vector3f pos, Eigen::Vector3f normal) {
-	const int n_samples = 5;
-	
-	Colorf accum(0, 0, 0);
-	for(int i = 0; i < n_samples; i++) {
-		auto dir = sample_hemisphere(random, normal);
-		Ray ray(pos + normal * 1e-5, dir);
-		accum += getRadiance(ray) * normal.dot(dir);
+std::vector<Colorf> Scene::getRadiance(const std::vector<Ray>& rays) {
+	std::vector<Colorf> radiances;
+	radiances.reserve(rays.size());
+	for(int offset = 0; offset < rays.size(); offset += simd_width) {
+		const int n = std::min(simd_width, static_cast<int>(rays.size()) - offset);
+		std::array<Hit, simd_width> hits;
+		if(lighting_result) {
+			lighting_result->scene->bvh.intersect(RayPacket(&rays[offset], n), hits.data());
+		}
+
+		for(int i = 0; i < n; i++) {
+			const Ray& ray = rays[offset + i];
+			radiances.push_back(hits[i].index >= 0 ?
+				lighting_result->getRadiance(hits[i]) :
+				sky_map->getRadianceAt(ray.dir));
+		}
 	}
-	assert(std::isfinite(accum[0]) && std::isfinite(accum[1]) && std::isfinite(accum[2]));
-	return accum / n_samples;
+	return radiances;
 }
 
 std::shared_ptr<Texture> Scene::getBackgroundImage() {
 	return sky.generateEquirectangular();
 }
 
-void Scene::render(const float* projection) {
+void Scene::setSunDirection(Eigen::Vector3f dir) {
+	sky.setSunDirection(dir);
+	sky_changed = true;
+}
+
+void Scene::updateSky() {
+	steps_since_sky_update++;
+	if(!sky_changed || steps_since_sky_update < sky_update_interval) {
+		return;
+	}
+	sky_changed = false;
+	steps_since_sky_update = 0;
+
+	sky_map = std::make_shared<SkyRadianceMap>(sky);
+	lighting->setSkyMap(sky_map);
+
+	// Caching is pointless, since the Sun would keep moving.
 	for(auto& pair : objects) {
-		auto& object = pair.second;
+		if(pair.second->type == ObjectType::SKY) {
+			pair.second->texture = sky.generateEquirectangular("");
+		}
+	}
+}
+
+std::tuple<int, float, GLuint, GLuint, float> RenderItem::getKey() const {
+	if(pass == BLENDED) {
+		return std::make_tuple(pass, -depth, shader, texture, 0.0f);
+	} else {
+		return std::make_tuple(pass, 0.0f, shader, texture, depth);
+	}
+}
 
-		if(object->type != UI_CURSOR) {
-			renderObject(*object, projection);
+void Scene::render(const float* projection_left, const float* projection_right) {
+	// Shaders pick the eye by gl_InstanceID, so each draw covers both.
+	std::array<float, 4 * 4 * n_eyes> projections;
+	std::copy(projection_left, projection_left + 16, projections.begin());
+	std::copy(projection_right, projection_right + 16, projections.begin() + 16);
+	glEnable(GL_CLIP_DISTANCE0);
+
+	RenderState state;
+	state.projection = projections.data();
+	state.shader = nullptr;
+	state.texture = nullptr;
+	state.blend = false;
+	irradiance_buffer->useIn(0);
+
+	// Most of STATIC objects at once.
+	if(static_batch) {
+		Eigen::Matrix<float, 4, 4, Eigen::RowMajor> m =
+			Eigen::Matrix4f::Identity();
+
+		useShader(state, *standard_shader);
+		standard_shader->setUniformMat4("local_to_world", m.data());
+		standard_shader->setUniform("irradiance_offset", 0);
+		static_batch->render(n_eyes);
+	}
+
+	// Then one call per shared mesh.
+	if(!instance_batches.empty()) {
+		useShader(state, *instance_shader);
+		for(auto& pair : instance_batches) {
+			pair.first->renderInstanced(*pair.second, n_eyes);
 		}
 	}
 
+	// And the rest one by one.
+	std::vector<RenderItem> queue;
 	for(auto& pair : objects) {
-		auto& object = pair.second;
-
-		if(object->type == UI_CURSOR) {
-			renderObject(*object, projection);
+		auto item = createRenderItem(*pair.second, state.projection);
+		if(item) {
+			queue.push_back(*item);
 		}
 	}
+	std::sort(queue.begin(), queue.end(),
+		[](const RenderItem& a, const RenderItem& b) {
+			return a.getKey() < b.getKey();
+		});
+	for(const auto& item : queue) {
+		renderObject(*item.object, state);
+	}
+
+	useBlend(state, false);
+	glDisable(GL_CLIP_DISTANCE0);
 }
 
-void Scene::renderObject(Object& object, const float* projection) {
-	if(object.use_blend) {
-		glEnable(GL_BLEND);
-		
-		// additive blending
-		// glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+boost::optional<RenderItem> Scene::createRenderItem(Object& object, const float* projection) {
+	RenderItem item;
+	item.object = &object;
+	item.pass = object.use_blend ? RenderItem::BLENDED : RenderItem::OPAQUE;
 
-		// alpha blend
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	// Depth of some representative point.
+	Eigen::Vector3f center;
+	if(object.type == ObjectType::UI || object.type == UI_CURSOR) {
+		item.shader = texture_shader->unsafeGetId();
+		item.texture = object.texture ? object.texture->unsafeGetId() : 0;
+		center = object.getLocalToWorld().translation();
+		if(object.type == UI_CURSOR) {
+			item.pass = RenderItem::CURSOR;
+		}
+	} else if(object.type == ObjectType::SKY) {
+		item.pass = RenderItem::SKY;
+		item.shader = texture_shader->unsafeGetId();
+		item.texture = object.texture ? object.texture->unsafeGetId() : 0;
+		item.depth = 0;
+		return item;
+	} else if(object.type == ObjectType::STATIC) {
+		// Objects added after last step are drawn from next frame.
+		auto it = static_ranges.find(object.id);
+		if(it == static_ranges.end() || isBatched(object, it->second)) {
+			return boost::none;
+		}
+
+		item.shader = standard_shader->unsafeGetId();
+		item.texture = 0;
+		Eigen::AlignedBox3f bounds;
+		for(int i = it->second.first; i < it->second.first + it->second.count; i++) {
+			for(int j = 0; j < 3; j++) {
+				bounds.extend(tris[i].getVertexPos(j));
+			}
+		}
+		center = bounds.center();
+	} else {
+		throw "Unknown ObjectType";
 	}
 
+	// w of clip coordinates (4th row of projections), averaged over eyes.
+	item.depth = 0;
+	for(int eye = 0; eye < n_eyes; eye++) {
+		const float* row = projection + 16 * eye + 12;
+		item.depth += (row[0] * center.x() + row[1] * center.y() + row[2] * center.z() + row[3]) / n_eyes;
+	}
+	return item;
+}
+
+void Scene::renderObject(Object& object, RenderState& state) {
+	std::shared_ptr<Geometry> geometry = object.geometry;
+	useBlend(state, object.use_blend);
+
 	if(object.type == ObjectType::UI || object.type == UI_CURSOR) {
 		Eigen::Matrix<float, 4, 4, Eigen::RowMajor> m =
 			object.getLocalToWorld().matrix();
 
-		object.texture->useIn(0);
-		texture_shader->use();
-		texture_shader->setUniformMat4("world_to_screen", projection);
-		texture_shader->setUniform("texture", 0);
+		useTexture(state, *object.texture);
+		useShader(state, *texture_shader);
 		texture_shader->setUniform("luminance", 25.0f);
 		texture_shader->setUniformMat4("local_to_world", m.data());
 	} else if(object.type == ObjectType::SKY) {
 		Eigen::Matrix<float, 4, 4, Eigen::RowMajor> m =
 			Eigen::Matrix4f::Identity();
 
-		object.texture->useIn(0);
-		texture_shader->use();
-		texture_shader->setUniformMat4("world_to_screen", projection);
-		texture_shader->setUniform("texture", 0);
+		useTexture(state, *object.texture);
+		useShader(state, *texture_shader);
 		texture_shader->setUniform("luminance", 1.0f);
 		texture_shader->setUniformMat4("local_to_world", m.data());
 	} else if(object.type == ObjectType::STATIC) {
-		standard_shader->use();
-		standard_shader->setUniformMat4("world_to_screen", projection);
+		// render() only passes objects in static_ranges.
+		const TriangleRange& range = static_ranges.at(object.id);
+
+		// lit_geometry is in world coordinates, even for instances.
+		Eigen::Matrix<float, 4, 4, Eigen::RowMajor> m =
+			Eigen::Matrix4f::Identity();
+		if(object.instance && !range.lit_geometry) {
+			m = object.instance->local_to_world.matrix();
+		}
+
+		useShader(state, *standard_shader);
+		standard_shader->setUniformMat4("local_to_world", m.data());
+
+		// Finer mesh from lighting.
+		if(range.lit_geometry) {
+			geometry = range.lit_geometry;
+			standard_shader->setUniform("irradiance_offset", range.lit_offset);
+		} else {
+			standard_shader->setUniform("irradiance_offset", 3 * range.first);
+		}
 	} else {
 		throw "Unknown ObjectType";
 	}
-	object.geometry->render();
+	geometry->render(n_eyes);
+}
+
+void Scene::useShader(RenderState& state, Shader& shader) {
+	if(state.shader == &shader) {
+		return;
+	}
+
+	// Samplers are fixed in constructor; only projection is per frame.
+	shader.use();
+	shader.setUniformMat4("world_to_screen", state.projection, n_eyes);
+	state.shader = &shader;
+}
+
+void Scene::useTexture(RenderState& state, Texture& texture) {
+	if(state.texture == &texture) {
+		return;
+	}
+
+	// Slot 0 also has irradiance_buffer, but as a different target.
+	texture.useIn(0);
+	state.texture = &texture;
+}
+
+void Scene::useBlend(RenderState& state, bool blend) {
+	if(state.blend == blend) {
+		return;
+	}
 
-	if(object.use_blend) {
+	if(blend) {
+		glEnable(GL_BLEND);
+
+		// additive blending
+		// glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+		// alpha blend
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	} else {
 		glDisable(GL_BLEND);
 	}
+	state.blend = blend;
 }
 
 }  // namespace
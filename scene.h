@@ -4,6 +4,7 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <random>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -15,8 +16,10 @@
 #include <GL/glew.h>
 #include <glfw3.h>
 
+#include "bvh.h"
 #include "gl.h"
 #include "light.h"
+#include "lighting.h"
 #include "scene.h"
 #include "sky.h"
 #include "util.h"
@@ -57,6 +60,39 @@ enum ObjectType {
 	SKY,
 };
 
+// Placement of a mesh shared by many STATIC objects.
+class Instance {
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	Transform3f local_to_world;
+
+	// Lambert reflectance. (not used in shading yet, as with colors of
+	// PosColor geometry)
+	Eigen::Vector3f reflectance;
+};
+
+
+// local_to_world of a UI object, remembering whether it moved since
+// UIGeometry last read it.
+class UITransform {
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	UITransform();
+
+	// Scripts tend to set transform every frame, even when not moving;
+	// only a different matrix sets dirty.
+	void set(const Transform3f& trans);
+	const Transform3f& get() const;
+
+	// Set when the transform changes. Cleared by UIGeometry::update.
+	bool dirty;
+private:
+	Transform3f trans;
+};
+
+
 // There are two kinds of objects:
 // * static (base shader): once it's put, it can't be moved freely
 //  (we don't yet have enough resource to make everything look good, freely movable,
@@ -64,6 +100,10 @@ enum ObjectType {
 // * UI (tex shader): can move freely, with almost no physics.
 class Object {
 public:
+	// local_to_world needs the alignment of vectorized Eigen types,
+	// which plain new doesn't give (e.g. 32 bytes with AVX).
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
 	Object(Scene& scene, ObjectId id);
 
 	// These details should not belong to Object. Instead,
@@ -74,6 +114,11 @@ public:
 	std::shared_ptr<Texture> texture;
 	std::unique_ptr<NativeScript> nscript;
 
+	// Only for STATIC. When set, geometry is a mesh in local coordinates
+	// (Pos format) shared with other objects, drawn by instancing.
+	// Call Scene::notifyGeometryChange after modifying it.
+	boost::optional<Instance> instance;
+
 	void addMessage(Json::Value value);
 	boost::optional<Json::Value> getMessage();
 
@@ -85,13 +130,13 @@ public:
 
 	bool use_blend;
 
+	// Only used when type == UI.
+	UITransform local_to_world;
+
 	// Object doesn't own an id. It's borrowed from Scene.
 	const ObjectId id;
 private:
 	std::vector<Json::Value> queue;
-
-	// Only used when type == UI.
-	Transform3f local_to_world;
 };
 
 
@@ -102,6 +147,178 @@ public:
 };
 
 
+// Triangles of a STATIC object in Scene::tris.
+class TriangleRange {
+public:
+	int first;
+	int count;
+
+	// To detect replacement of Object::geometry.
+	// (holding it prevents address reuse)
+	std::shared_ptr<const Geometry> geometry;
+
+	// Set by Scene::notifyGeometryChange.
+	bool dirty;
+
+	// Rendered instead of geometry when lighting subdivided its faces.
+	// Pos format; irradiance of vertex i is texel lit_offset + i of
+	// Scene::irradiance_buffer.
+	std::shared_ptr<Geometry> lit_geometry;
+	int lit_offset;
+};
+
+
+// Slots of STATIC objects in Scene::tris (and LightingScene::tris). First fit;
+// freed slots are reused, and the array only grows.
+class TriangleSlots {
+public:
+	TriangleSlots();
+
+	// Return first of count consecutive unused slots.
+	int allocate(int count);
+	void free(int first, int count);
+
+	// # of slots, used or not.
+	int size() const;
+private:
+	// Unused slots (first -> count). Adjacent ones are always merged.
+	std::map<int, int> free_ranges;
+	int n_slots;
+};
+
+
+// Texels of Scene::irradiance_buffer as weighted sums of irradiance of
+// lighting vertices, so that only texels of updated vertices are recomputed.
+class IrradianceTexels {
+public:
+	IrradianceTexels();
+
+	// Remove all texels.
+	void clear();
+
+	// Add weight * irradiance of vertex to the texel being added.
+	void addTerm(int vertex, float weight);
+	// Finish the texel being added. Texels without terms are black.
+	void endTexel();
+
+	// Index texels by vertex. Call after adding texels, before appendTexels.
+	void buildIndex(int n_vertices);
+
+	int size() const;
+	Colorf getIrradiance(int texel, const std::vector<Colorf>& irradiance) const;
+
+	// Append texels that use vertex to texels.
+	void appendTexels(int vertex, std::vector<int>& texels) const;
+private:
+	// Terms of texel i are [offsets[i], offsets[i + 1]).
+	std::vector<int> offsets;
+	std::vector<int> vertices;
+	std::vector<float> weights;
+
+	// Texels of vertex v are vertex_texels[vertex_offsets[v], vertex_offsets[v + 1]).
+	std::vector<int> vertex_offsets;
+	std::vector<int> vertex_texels;
+};
+
+
+// Entry of the per-frame render queue of Scene::render.
+class RenderItem {
+public:
+	enum Pass {
+		OPAQUE,
+		// After all opaque items, so that the depth test rejects hidden sky.
+		SKY,
+		BLENDED,
+		// Drawn after everything else.
+		CURSOR,
+	};
+
+	// Items are drawn in ascending order of this. Opaque ones are grouped
+	// by state, then front to back (fewer overdraws). Blended ones are
+	// back to front, for correct compositing.
+	std::tuple<int, float, GLuint, GLuint, float> getKey() const;
+
+	Pass pass;
+	// GL names, which are stable for the lifetime of the objects.
+	GLuint shader;
+	// 0 when not textured.
+	GLuint texture;
+	// Distance from the eyes along view direction.
+	float depth;
+
+	Object* object;
+};
+
+
+// GL state during Scene::render, to skip redundant changes.
+class RenderState {
+public:
+	// world to screen of both eyes.
+	const float* projection;
+
+	// Currently bound. nullptr when unknown.
+	Shader* shader;
+	Texture* texture;
+	bool blend;
+};
+
+
+// Triangles of a UI object in UIGeometry::tris.
+class UITriangles {
+public:
+	// Extracted from this. Replacing Object::geometry causes re-extraction.
+	std::shared_ptr<const Geometry> geometry;
+
+	// Before applying local_to_world.
+	std::vector<Triangle> tris_local;
+
+	// tris[first, first + tris_local.size()) belongs to the object.
+	int first;
+};
+
+
+// What UIGeometry::update did.
+enum UIUpdate {
+	UI_UPDATE_NONE,
+	UI_UPDATE_REFIT,
+	UI_UPDATE_BUILD,
+};
+
+
+// World-space triangles of UI objects and their bvh. UI moves every frame,
+// but its structure rarely changes; moved objects only cost a refit.
+class UIGeometry {
+public:
+	UIGeometry();
+
+	// Call for every UI object in id order, then call update.
+	// pos_uv (PosUV format) is only read when geometry is new.
+	void add(ObjectId id, std::shared_ptr<const Geometry> geometry,
+		const std::vector<float>& pos_uv, UITransform& local_to_world);
+	// Rebuild when objects or their geometries changed, otherwise re-transform
+	// moved ones and refit.
+	UIUpdate update();
+
+	boost::optional<Intersection> intersect(Ray ray) const;
+
+	std::vector<Triangle> tris;
+	BVH bvh;
+private:
+	// Arguments of add since last update.
+	class Item {
+	public:
+		ObjectId id;
+		std::shared_ptr<const Geometry> geometry;
+		const std::vector<float>* pos_uv;
+		UITransform* local_to_world;
+	};
+	std::vector<Item> items;
+
+	// Same order as objects.
+	std::map<ObjectId, UITriangles> caches;
+};
+
+
 // Rendering equation for surfaces:
 // radiance(pos, dir) = radiance_emit(pos, dir) + 
 //   integral(brdf(pos, dir, dir_in) * radiance(pos, -dir_in) * normal(pos).dot(dir_in)
@@ -122,29 +339,61 @@ public:
 // lighting pass treats scene as triangle soup.
 class Scene {
 public:
-	Scene();
+	// n_lighting_threads: # of threads used in lighting. 0 means # of cores - 1.
+	Scene(int n_lighting_threads = 0, LightingMode lighting_mode = GATHER);
 
 	ObjectId add();
 	Object& unsafeGet(ObjectId);
 
 	void step();
-	void render(const float* projection);
+	// Draw left eye to left half of viewport, right eye to right half, in
+	// one pass. projection_*: world to screen (4x4 row-major) of each eye.
+	void render(const float* projection_left, const float* projection_right);
 	
 	void sendMessage(ObjectId destination, Json::Value value);
 	void deleteObject(ObjectId target);
 
+	// Extract triangles of STATIC objects, and send them to lighting.
+	// Incremental; only objects that are added, deleted, have new geometry, or
+	// are notified by notifyGeometryChange are processed.
 	void updateGeometry();
 
+	// Call after modifying geometry data of a STATIC object in place.
+	void notifyGeometryChange(ObjectId id);
+
+	// Save irradiance of STATIC objects to path. Throws on failure.
+	void saveIrradiance(const std::string& path);
+
+	// Restore irradiance (and convergence) of STATIC objects whose geometry
+	// is the same as when saved, when the sky is also the same. Others, and
+	// restored places that see them, are lit as usual.
+	// Missing or broken file is ignored.
+	void loadIrradiance(const std::string& path);
+
 	std::shared_ptr<Texture> getBackgroundImage();
 
+	// Move the Sun. Cheap enough to call every frame; lighting and SKY
+	// objects follow in step(), at most once per sky_update_interval steps.
+	void setSunDirection(Eigen::Vector3f dir);
+
 	Colorf getRadiance(Ray ray);
 
+	// Same as getRadiance for each ray, but faster for coherent rays.
+	std::vector<Colorf> getRadiance(const std::vector<Ray>& rays);
+
 	// Return (pos, normal) of the intersection. Targets are
 	// STATIC and UI.
 	boost::optional<Intersection> intersectAny(Ray ray);
 private:
-	// hackish way to solve transparency problem.
-	void renderObject(Object& object, const float* projection);
+	// Queue item for object, or none when it's not drawn individually.
+	boost::optional<RenderItem> createRenderItem(Object& object, const float* projection);
+
+	// Draw object, changing only GL state that differs from state.
+	void renderObject(Object& object, RenderState& state);
+
+	void useShader(RenderState& state, Shader& shader);
+	void useTexture(RenderState& state, Texture& texture);
+	void useBlend(RenderState& state, bool blend);
 
 	// TODO: Current process is tangled. Fix it.
 	// ideal:
@@ -152,34 +401,82 @@ private:
 	//   Scene.Geometry
 	// now:
 	//   Object.Geometry -(updateGeometry)->
-	//   Scene.triangles -(updateLighting)->
-	//   Scene.triangles -(updateIrradiance)->
-	//   Object.Geometry
-	
-	void updateLighting();
+	//   LightingChange -(Lighting, in background)->
+	//   LightingScene, LightingResult -(updateIrradiance)->
+	//   Scene.triangles, irradiance_buffer
 	void updateIrradiance();
+
+	// Rebuild irradiance_texels, and lit_geometry of subdivided ranges, for
+	// a new scene of lighting_result. Only changed texels are uploaded.
+	// Return true when lit_geometry of any range changed.
+	bool rebuildIrradianceBuffer();
+
+	// Recompute texels of vertices of lighting_result->scene. Only changed
+	// texels are uploaded.
+	void updateIrradianceBuffer(const std::vector<int>& vertices);
+
+	// Recompute texel (and the corner of tris it is) from lighting_result.
+	// Return true when it changed.
+	bool updateTexel(int texel);
+
+	// true when object is drawn as a part of static_batch or
+	// instance_batches.
+	bool isBatched(const Object& object, const TriangleRange& range) const;
+
+	// Write positions of batched objects to static_batch, and instances to
+	// instance_batches. Only changed vertices are uploaded.
+	void updateStaticBatch();
 	
 	void updateUIGeometry();
 
+	// Rebuild sky_map and textures of SKY objects when the Sun moved.
+	void updateSky();
+
 	boost::optional<Intersection> intersectUI(Ray ray);
 	boost::optional<Intersection> intersect(Ray ray);
 
-	// Approximate integral(irradiance(pos, -dir_in) * normal(pos).dot(dir_in) for dir_in in sphere)
-	// return value: radiance
-	Colorf collectIrradiance(Eigen::Vector3f pos, Eigen::Vector3f normal);
-
-	std::mt19937 random;
-	int lighting_counter;
+	// Return first index of unused count triangles in tris.
+	int allocateTriangles(int count);
 private:
 	Sky sky;
+	// For rays escaping the scene. Way faster than sky.getRadianceAt.
+	std::shared_ptr<const SkyRadianceMap> sky_map;
+	// sky changed after sky_map (and SKY textures) were built.
+	bool sky_changed;
+	int steps_since_sky_update;
+	std::unique_ptr<Lighting> lighting;
 	
 	// shaders
 	std::shared_ptr<Shader> standard_shader;
 	std::shared_ptr<Shader> texture_shader;
+	std::shared_ptr<Shader> instance_shader;
+
+	// Irradiance of STATIC vertices read by standard_shader. Texel 3i + j is
+	// corner j of tris[i]; texels of lit_geometry follow.
+	std::shared_ptr<TextureBuffer> irradiance_buffer;
+	// Copy of irradiance_buffer content, to find changed texels.
+	std::vector<uint16_t> irradiance_texels;
+	// How texels are made from lighting_result.
+	IrradianceTexels texel_sources;
+	// Positions of tris (3 vertices each), so that most of STATIC objects
+	// are drawn by one call. Same vertex order as irradiance_buffer.
+	// Slots of instances are left degenerate. nullptr when empty.
+	std::shared_ptr<Geometry> static_batch;
+	// Batched instances of each shared mesh, drawn by one call per mesh.
+	// Row: local_to_world (3 rows of 4), texel of vertex 0.
+	std::map<std::shared_ptr<Geometry>, std::shared_ptr<InstanceArray>> instance_batches;
 
 	// geometry
+	// # of Lighting::updateGeometry calls.
+	int n_lighting_updates;
+	// Last result applied to tris. Its scene has the same layout as tris
+	// (as of when it was applied), and is used for intersection.
+	std::shared_ptr<const LightingResult> lighting_result;
+	// Triangles of STATIC objects, with irradiance of lighting_result.
 	std::vector<Triangle> tris;
-	std::vector<Triangle> tris_ui;
+	std::map<ObjectId, TriangleRange> static_ranges;
+	TriangleSlots slots;
+	UIGeometry ui_geometry;
 
 	// nodes
 	std::map<ObjectId, std::unique_ptr<Object>> objects;
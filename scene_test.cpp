@@ -1,12 +1,37 @@
 #include "scene.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <random>
+#include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 #include "gtest/gtest.h"
 
+#include "bake.h"
+#include "radiosity.h"
+#include "sampling.h"
+
 using namespace construct;
 
+// Return path of a new empty directory, so that tests never write to
+// the working directory.
+std::string createTempDir() {
+	char path[] = "/tmp/construct_test-XXXXXX";
+	if(!mkdtemp(path)) {
+		throw "Couldn't create temp dir";
+	}
+	return path;
+}
+
 TEST(TriangleTest, IntersectionIsValid) {
 	Triangle triangle(
 		Eigen::Vector3f(0, 0, 0),
@@ -36,3 +61,1369 @@ TEST(TriangleTest, IntersectionIsValid) {
 	EXPECT_LE(0, isect.radiance[1]);
 	EXPECT_LE(0, isect.radiance[2]);
 }
+
+TEST(TriangleTest, TransformedSameAsTransformingVertices) {
+	Triangle tri(
+		Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0));
+	tri.attribute = 3;
+
+	Eigen::Affine3f trans = Eigen::Translation3f(1, 2, 3) *
+		Eigen::AngleAxisf(0.5, Eigen::Vector3f(1, 1, 0).normalized()) *
+		Eigen::Scaling(2.0f);
+	Triangle expected(
+		trans * tri.getVertexPos(0), trans * tri.getVertexPos(1), trans * tri.getVertexPos(2));
+	Triangle actual = tri.transformed(trans);
+
+	EXPECT_EQ(3, actual.attribute);
+	for(int i = 0; i < 3; i++) {
+		EXPECT_TRUE(expected.getVertexPos(i).isApprox(actual.getVertexPos(i), 1e-5));
+	}
+	EXPECT_TRUE(expected.getNormal().isApprox(actual.getNormal(), 1e-5));
+}
+
+TEST(TriangleTest, IrradianceKeepsHalfPrecision) {
+	Triangle tri(Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0));
+	EXPECT_EQ(Colorf(0, 0, 0), tri.getIrradiance(1));
+
+	const Colorf values[] = {
+		Colorf(0.5, 1, 2), Colorf(1e-3, 3.14159, 12345.6), Colorf(1e-6, 0, 60000)};
+	for(const auto& value : values) {
+		tri.setIrradiance(2, value);
+		const Colorf actual = tri.getIrradiance(2);
+		for(int i = 0; i < 3; i++) {
+			EXPECT_NEAR(value[i], actual[i], value[i] * 1e-3 + 1e-7);
+		}
+	}
+	EXPECT_EQ(Colorf(0, 0, 0), tri.getIrradiance(0));
+}
+
+// Random soup of small triangles, similar in density to a building.
+std::vector<Triangle> generateRandomTriangles(int n, std::mt19937& random) {
+	std::uniform_real_distribution<float> pos(-5, 5);
+	std::uniform_real_distribution<float> offset(-0.3, 0.3);
+
+	std::vector<Triangle> tris;
+	for(int i = 0; i < n; i++) {
+		const Eigen::Vector3f p0(pos(random), pos(random), pos(random));
+		Triangle tri(p0,
+			p0 + Eigen::Vector3f(offset(random), offset(random), offset(random)),
+			p0 + Eigen::Vector3f(offset(random), offset(random), offset(random)));
+		tri.attribute = i;
+		tris.push_back(tri);
+	}
+	return tris;
+}
+
+std::vector<Ray> generateRandomRays(int n, std::mt19937& random) {
+	std::uniform_real_distribution<float> pos(-6, 6);
+
+	std::vector<Ray> rays;
+	for(int i = 0; i < n; i++) {
+		const Eigen::Vector3f org(pos(random), pos(random), pos(random));
+		rays.emplace_back(org, sample_hemisphere(random, Eigen::Vector3f::UnitZ()));
+	}
+	return rays;
+}
+
+boost::optional<Intersection> intersectBruteForce(std::vector<Triangle>& tris, Ray ray) {
+	boost::optional<Intersection> isect_nearest;
+	for(auto& tri : tris) {
+		auto isect = tri.intersect(ray);
+		if(isect && (!isect_nearest || isect->t < isect_nearest->t)) {
+			isect_nearest = isect;
+		}
+	}
+	return isect_nearest;
+}
+
+TEST(BVHTest, SameAsBruteForce) {
+	std::mt19937 random;
+	auto tris = generateRandomTriangles(2000, random);
+
+	BVH bvh;
+	bvh.build(tris);
+
+	int n_hits = 0;
+	for(auto& ray : generateRandomRays(2000, random)) {
+		auto isect_ref = intersectBruteForce(tris, ray);
+		auto isect = bvh.intersect(tris, ray);
+
+		ASSERT_EQ(static_cast<bool>(isect_ref), static_cast<bool>(isect));
+		if(isect_ref) {
+			EXPECT_EQ(isect_ref->id, isect->id);
+			EXPECT_NEAR(isect_ref->t, isect->t, 1e-4);
+			n_hits++;
+		}
+	}
+
+	// Make sure the test is not trivial.
+	EXPECT_LT(50, n_hits);
+}
+
+TEST(BVHTest, RefitFollowsMovedTriangles) {
+	std::mt19937 random;
+	auto tris = generateRandomTriangles(500, random);
+
+	BVH bvh;
+	bvh.build(tris);
+
+	const Eigen::Vector3f shift(0.5, -0.2, 1);
+	for(auto& tri : tris) {
+		tri.p0 += shift;
+	}
+	bvh.refit(tris);
+
+	for(auto& ray : generateRandomRays(500, random)) {
+		auto isect_ref = intersectBruteForce(tris, ray);
+		auto isect = bvh.intersect(tris, ray);
+
+		ASSERT_EQ(static_cast<bool>(isect_ref), static_cast<bool>(isect));
+		if(isect_ref) {
+			EXPECT_EQ(isect_ref->id, isect->id);
+		}
+	}
+}
+
+// Run with --gtest_also_run_disabled_tests.
+TEST(BVHBench, DISABLED_RaysPerSecond) {
+	std::mt19937 random;
+	auto tris = generateRandomTriangles(20000, random);
+	auto rays = generateRandomRays(20000, random);
+
+	BVH bvh;
+	bvh.build(tris);
+
+	auto measure = [&](std::function<void(Ray)> f, int n_rays) {
+		const auto t0 = std::chrono::steady_clock::now();
+		for(int i = 0; i < n_rays; i++) {
+			f(rays[i]);
+		}
+		const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+		return n_rays / dt.count();
+	};
+
+	const double rps_brute = measure([&](Ray ray) {
+		intersectBruteForce(tris, ray);
+	}, 200);
+	const double rps_bvh = measure([&](Ray ray) {
+		bvh.intersect(tris, ray);
+	}, rays.size());
+
+	std::cout << "brute force: " << rps_brute << " rays/sec" << std::endl;
+	std::cout << "BVH: " << rps_bvh << " rays/sec" << std::endl;
+}
+
+// Triangle::intersect is the reference for SIMD kernels.
+TEST(TriangleBlockTest, SameAsScalar) {
+	std::mt19937 random;
+	auto tris = generateRandomTriangles(simd_width * 50, random);
+	auto rays = generateRandomRays(simd_width * 50, random);
+
+	// Make rays hit something more often.
+	for(int i = 0; i < rays.size(); i++) {
+		const Eigen::Vector3f center =
+			(tris[i].getVertexPos(0) + tris[i].getVertexPos(1) + tris[i].getVertexPos(2)) / 3;
+		rays[i].dir = (center - rays[i].org).normalized();
+	}
+
+	std::vector<TriangleBlock> blocks(tris.size() / simd_width);
+	for(int i = 0; i < tris.size(); i++) {
+		blocks[i / simd_width].set(i % simd_width, tris[i], i);
+	}
+
+	for(int offset = 0; offset < rays.size(); offset += simd_width) {
+		// Single ray vs. block.
+		std::array<Hit, simd_width> hits_single;
+		for(int i = 0; i < simd_width; i++) {
+			for(const auto& block : blocks) {
+				block.intersect(rays[offset + i], hits_single[i]);
+			}
+		}
+
+		// Ray packet vs. block.
+		std::array<Hit, simd_width> hits_packet;
+		RayPacket packet(&rays[offset], simd_width);
+		for(const auto& block : blocks) {
+			block.intersect(packet, hits_packet.data());
+		}
+
+		for(int i = 0; i < simd_width; i++) {
+			auto isect_ref = intersectBruteForce(tris, rays[offset + i]);
+			for(const auto& hit : {hits_single[i], hits_packet[i]}) {
+				ASSERT_EQ(static_cast<bool>(isect_ref), hit.index >= 0);
+				if(isect_ref) {
+					auto isect = tris[hit.index].createIntersection(rays[offset + i], hit);
+					EXPECT_EQ(isect_ref->id, isect.id);
+					// Rounding differs from scalar code (e.g. FMA).
+					EXPECT_NEAR(isect_ref->t, isect.t, 1e-4);
+					EXPECT_NEAR(0, (isect_ref->position - isect.position).norm(), 1e-4);
+				}
+			}
+		}
+	}
+}
+
+TEST(BVHTest, PacketSameAsSingleRay) {
+	std::mt19937 random;
+	auto tris = generateRandomTriangles(2000, random);
+	auto rays = generateRandomRays(simd_width * 100, random);
+
+	BVH bvh;
+	bvh.build(tris);
+
+	for(int offset = 0; offset < rays.size(); offset += simd_width) {
+		std::array<Hit, simd_width> hits;
+		bvh.intersect(RayPacket(&rays[offset], simd_width), hits.data());
+
+		for(int i = 0; i < simd_width; i++) {
+			auto isect = bvh.intersect(tris, rays[offset + i]);
+			ASSERT_EQ(static_cast<bool>(isect), hits[i].index >= 0);
+			if(isect) {
+				EXPECT_EQ(isect->id, tris[hits[i].index].attribute);
+				EXPECT_NEAR(isect->t, hits[i].t, 1e-5);
+			}
+		}
+	}
+}
+
+TEST(TwoLevelBVHTest, SameAsBruteForce) {
+	std::mt19937 random(1);
+	auto tris = generateRandomTriangles(300, random);
+
+	// 10 objects of 30 tris. Remove one, then change another.
+	TwoLevelBVH bvh;
+	for(int i = 0; i < 10; i++) {
+		bvh.setObject(i, tris, i * 30, 30);
+	}
+	bvh.removeObject(3);
+	for(int i = 5 * 30; i < 6 * 30; i++) {
+		tris[i] = Triangle(
+			tris[i].getVertexPos(0) + Eigen::Vector3f(0.5, 0, 0),
+			tris[i].getVertexPos(1), tris[i].getVertexPos(2));
+		tris[i].attribute = i;
+	}
+	bvh.setObject(5, tris, 5 * 30, 30);
+	bvh.buildTop();
+
+	std::vector<Triangle> tris_alive;
+	for(int i = 0; i < tris.size(); i++) {
+		if(i / 30 != 3) {
+			tris_alive.push_back(tris[i]);
+		}
+	}
+
+	for(const auto& ray : generateRandomRays(1000, random)) {
+		auto expected = intersectBruteForce(tris_alive, ray);
+		auto actual = bvh.intersect(tris, ray);
+		ASSERT_EQ(static_cast<bool>(expected), static_cast<bool>(actual));
+		if(expected) {
+			EXPECT_NEAR(expected->t, actual->t, 1e-4);
+		}
+	}
+}
+
+TEST(TwoLevelBVHTest, OccludedSameAsClosestHit) {
+	std::mt19937 random(2);
+	auto tris = generateRandomTriangles(300, random);
+
+	TwoLevelBVH bvh;
+	for(int i = 0; i < 10; i++) {
+		bvh.setObject(i, tris, i * 30, 30);
+	}
+	bvh.buildTop();
+
+	std::uniform_real_distribution<float> t_max_dist(0, 5);
+	for(const auto& ray : generateRandomRays(1000, random)) {
+		const Hit hit = bvh.closestHit(ray);
+		const float t_max = t_max_dist(random);
+		EXPECT_EQ(hit.index >= 0 && hit.t < t_max, bvh.occluded(ray, t_max));
+		EXPECT_EQ(hit.index >= 0,
+			bvh.occluded(ray, std::numeric_limits<float>::infinity()));
+	}
+}
+
+TEST(LightingTest, PublishesResultForLatestScene) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	// Floor quad facing the sky.
+	auto scene = std::make_shared<LightingScene>();
+	scene->tris.emplace_back(
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(1, -1, 0), Eigen::Vector3f(-1, 1, 0));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, -1, 0));
+	scene->bvh.setObject(0, scene->tris, 0, 2);
+	scene->bvh.buildTop();
+	scene->active.resize(2, true);
+	scene->buildMesh();
+	lighting.setScene(scene);
+
+	std::shared_ptr<const LightingResult> result;
+	for(int i = 0; i < 500; i++) {
+		result = lighting.getResult();
+		if(result && result->scene == scene) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	ASSERT_TRUE(result);
+	ASSERT_EQ(scene, result->scene);
+	ASSERT_EQ(4, result->irradiance.size());
+
+	// Sky is the only light source, and it's visible from everywhere.
+	for(const auto& ir : result->irradiance) {
+		EXPECT_LT(0, ir.sum());
+	}
+}
+
+TEST(LightingSceneTest, WeldsSharedCorners) {
+	// Quad, and a triangle sharing an edge with it but facing the other way.
+	LightingScene scene;
+	scene.tris.emplace_back(
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(1, -1, 0), Eigen::Vector3f(-1, 1, 0));
+	scene.tris.emplace_back(
+		Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, -1, 0));
+	scene.tris.emplace_back(
+		Eigen::Vector3f(1, -1, 0), Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(0, 0, 1));
+	scene.tris.emplace_back(
+		Eigen::Vector3f(0, 0, 5), Eigen::Vector3f(1, 0, 5), Eigen::Vector3f(0, 1, 5));
+	scene.active = {true, true, true, false};
+	scene.buildMesh();
+
+	EXPECT_EQ(4 + 3, scene.vertices.size());
+	EXPECT_EQ(scene.corners[0][1], scene.corners[1][2]);
+	EXPECT_EQ(scene.corners[0][2], scene.corners[1][1]);
+	EXPECT_NE(scene.corners[0][1], scene.corners[2][0]);
+	EXPECT_EQ(-1, scene.corners[3][0]);
+
+	// Root faces are the whole tris.
+	ASSERT_EQ(4, scene.faces.size());
+	for(int i = 0; i < 4; i++) {
+		EXPECT_EQ(-1, scene.faces[i].children);
+		EXPECT_EQ(scene.corners[i], scene.faces[i].vertices);
+	}
+}
+
+TEST(LightingSceneTest, SubdividesWhereIrradianceChanges) {
+	// 8m x 8m quad, with a bright corner.
+	LightingScene scene;
+	scene.tris.emplace_back(
+		Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(8, 0, 0), Eigen::Vector3f(0, 8, 0));
+	scene.tris.emplace_back(
+		Eigen::Vector3f(8, 8, 0), Eigen::Vector3f(0, 8, 0), Eigen::Vector3f(8, 0, 0));
+	scene.active = {true, true};
+	scene.buildMesh();
+	ASSERT_EQ(4, scene.vertices.size());
+
+	std::vector<Colorf> irradiance(4, Colorf(1, 1, 1));
+	irradiance[scene.corners[0][0]] = Colorf(10, 10, 10);
+
+	// Uniform irradiance doesn't need vertices.
+	EXPECT_EQ(0, scene.subdivide(std::vector<Colorf>(4, Colorf(1, 1, 1)), 1000));
+
+	// Budget is respected.
+	EXPECT_EQ(0, scene.subdivide(irradiance, 6));
+	ASSERT_EQ(1, scene.subdivide(irradiance, 7));
+	EXPECT_EQ(7, scene.vertices.size());
+	EXPECT_EQ(-1, scene.faces[1].children);
+
+	// Keeps splitting toward the bright corner.
+	for(int i = 0; i < 3; i++) {
+		std::vector<Colorf> irradiance_new;
+		for(const auto& vertex : scene.vertices) {
+			irradiance_new.push_back(vertex.irradiance);
+		}
+		irradiance_new[scene.corners[0][0]] = Colorf(10, 10, 10);
+		EXPECT_LT(0, scene.subdivide(irradiance_new, 1000));
+	}
+
+	// Weights reproduce the hit position.
+	std::mt19937 random;
+	std::uniform_real_distribution<float> uniform(0, 1);
+	for(int i = 0; i < 100; i++) {
+		Hit hit;
+		hit.index = i % 2;
+		hit.a = uniform(random);
+		hit.b = uniform(random) * (1 - hit.a);
+
+		std::array<int, 3> vertices;
+		Eigen::Vector3f weights;
+		scene.getWeights(hit, vertices, weights);
+		const Triangle& tri = scene.tris[hit.index];
+		const Eigen::Vector3f expected = tri.p0 + hit.a * tri.d1 + hit.b * tri.d2;
+		Eigen::Vector3f pos = Eigen::Vector3f::Zero();
+		for(int j = 0; j < 3; j++) {
+			EXPECT_LE(-1e-4, weights[j]);
+			pos += weights[j] * scene.vertices[vertices[j]].pos;
+		}
+		EXPECT_NEAR(0, (expected - pos).norm(), 1e-4);
+	}
+
+	// Rebuilding keeps the same mesh.
+	LightingScene scene_new;
+	scene_new.tris = scene.tris;
+	scene_new.active = scene.active;
+	scene_new.inheritFaces(scene);
+	scene_new.buildMesh();
+	EXPECT_EQ(scene.vertices.size(), scene_new.vertices.size());
+	EXPECT_EQ(scene.faces.size(), scene_new.faces.size());
+	EXPECT_EQ(scene.midpoints.size(), scene_new.midpoints.size());
+}
+
+TEST(LightingSceneTest, LeafPolygonsHaveNoTJunctions) {
+	// 2m x 2m floor, and a wall on its x = 2 edge.
+	LightingScene scene;
+	scene.tris.emplace_back(
+		Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	scene.tris.emplace_back(
+		Eigen::Vector3f(2, 2, 0), Eigen::Vector3f(0, 2, 0), Eigen::Vector3f(2, 0, 0));
+	scene.tris.emplace_back(
+		Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(2, 2, 0), Eigen::Vector3f(2, 0, 2));
+	scene.active = {true, true, true};
+	scene.buildMesh();
+
+	std::vector<Colorf> irradiance(scene.vertices.size(), Colorf(1, 1, 1));
+	irradiance[scene.corners[1][0]] = Colorf(10, 10, 10);
+	ASSERT_EQ(1, scene.subdivide(irradiance, 1000));
+
+	auto has_point_at = [&](const std::vector<LightingPoint>& polygon, Eigen::Vector3f pos) {
+		for(const auto& point : polygon) {
+			const Eigen::Vector3f p =
+				scene.vertices[point.v0].pos * (1 - point.t) +
+				scene.vertices[point.v1].pos * point.t;
+			if((p - pos).norm() < 1e-4) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	// Split face is 4 triangles.
+	const auto split = scene.getLeafPolygons(1, 1);
+	ASSERT_EQ(4, split.size());
+	for(const auto& polygon : split) {
+		EXPECT_EQ(3, polygon.size());
+	}
+
+	// Neighbors get the midpoint of the shared edge, also across the crease.
+	const auto floor = scene.getLeafPolygons(0, 1);
+	ASSERT_EQ(1, floor.size());
+	EXPECT_EQ(4, floor[0].size());
+	EXPECT_TRUE(has_point_at(floor[0], Eigen::Vector3f(1, 1, 0)));
+	const auto wall = scene.getLeafPolygons(2, 1);
+	ASSERT_EQ(1, wall.size());
+	EXPECT_EQ(4, wall[0].size());
+	EXPECT_TRUE(has_point_at(wall[0], Eigen::Vector3f(2, 1, 0)));
+}
+
+TEST(SamplingTest, CosineHemisphereHasCosineDistribution) {
+	const Eigen::Vector3f normal = Eigen::Vector3f(1, -2, 0.5).normalized();
+
+	// E[cos] = 2/3 and E[cos^2] = 1/2 for pdf = cos / pi.
+	const int n = 4096;
+	float sum_cos = 0;
+	float sum_cos2 = 0;
+	for(int i = 0; i < n; i++) {
+		const auto dir = sampleCosineHemisphere(
+			sampleHalton2(i, hashToUnitSquare(7)), normal);
+		ASSERT_NEAR(1, dir.norm(), 1e-4);
+		const float cos = dir.dot(normal);
+		ASSERT_LE(-1e-4, cos);
+		sum_cos += cos;
+		sum_cos2 += cos * cos;
+	}
+	EXPECT_NEAR(2.0 / 3, sum_cos / n, 1e-2);
+	EXPECT_NEAR(0.5, sum_cos2 / n, 1e-2);
+}
+
+TEST(SamplingTest, RadicalInverse) {
+	EXPECT_FLOAT_EQ(0, radicalInverse(2, 0));
+	EXPECT_FLOAT_EQ(0.5, radicalInverse(2, 1));
+	EXPECT_FLOAT_EQ(0.25, radicalInverse(2, 2));
+	EXPECT_FLOAT_EQ(0.75, radicalInverse(2, 3));
+	EXPECT_FLOAT_EQ(1.0 / 3, radicalInverse(3, 1));
+	EXPECT_FLOAT_EQ(1.0 / 9, radicalInverse(3, 3));
+}
+
+TEST(SkyTest, SunIrradianceIsDecayed) {
+	Sky sky;
+	const Colorf ir = sky.getSunIrradiance();
+	EXPECT_NEAR(1, sky.getSunDirection().norm(), 1e-5);
+	for(int i = 0; i < 3; i++) {
+		EXPECT_LT(0, ir[i]);
+		EXPECT_GT(150e3 / 100, ir[i]);
+	}
+	// Blue decays more.
+	EXPECT_GT(ir[0], ir[2]);
+}
+
+TEST(SkyRadianceMapTest, SameAsSky) {
+	Sky sky;
+	SkyRadianceMap sky_map(sky);
+
+	std::mt19937 random(1);
+	for(int i = 0; i < 200; i++) {
+		const auto dir = sample_hemisphere(random, Eigen::Vector3f::UnitZ());
+		// Radiance is discontinuous at the horizon.
+		if(dir.z() < 0.1) {
+			continue;
+		}
+		const Colorf expected = sky.getRadianceAt(dir);
+		const Colorf actual = sky_map.getRadianceAt(dir);
+		for(int c = 0; c < 3; c++) {
+			EXPECT_NEAR(expected[c], actual[c], expected[c] * 0.05);
+		}
+	}
+
+	// Below horizon.
+	EXPECT_NEAR(0, sky_map.getRadianceAt(Eigen::Vector3f(0.1, 0.2, -1).normalized()).sum(), 1e-3);
+}
+
+TEST(SkyTest, EquirectangularDataSameAsRadiance) {
+	Sky sky;
+	const int width = 16;
+	const int height = 8;
+	const auto data = sky.generateEquirectangularData(width, height);
+	ASSERT_EQ(width * height * 3, data.size());
+
+	for(int y = 0; y < height; y++) {
+		for(int x = 0; x < width; x++) {
+			const Colorf expected = sky.getRadianceAt(
+				pi * static_cast<float>(y) / height,
+				2 * pi * static_cast<float>(x) / width);
+			for(int c = 0; c < 3; c++) {
+				EXPECT_NEAR(expected[c], data[(y * width + x) * 3 + c], expected[c] * 1e-4 + 1e-5);
+			}
+		}
+	}
+}
+
+TEST(SkyTest, EquirectangularCacheHitAndMiss) {
+	Sky sky;
+	const int width = 16;
+	const int height = 8;
+	const std::string temp_dir = createTempDir();
+	const std::string cache_dir = temp_dir + "/cache";
+	const std::string path = sky.getCachePath(cache_dir, width, height);
+
+	// Miss: generated, and stored (creating cache_dir).
+	const auto data = sky.loadEquirectangularData(cache_dir, width, height);
+	EXPECT_EQ(sky.generateEquirectangularData(width, height), data);
+	EXPECT_TRUE(std::ifstream(path).good());
+	EXPECT_FALSE(std::ifstream(path + ".tmp").good());
+
+	// Hit: whatever is in the file.
+	const std::vector<float> marker(width * height * 3, 42);
+	std::ofstream(path, std::ios::binary).write(
+		reinterpret_cast<const char*>(marker.data()), marker.size() * sizeof(float));
+	EXPECT_EQ(marker, sky.loadEquirectangularData(cache_dir, width, height));
+
+	// Truncated file is a miss, and gets replaced.
+	std::ofstream(path, std::ios::binary).write("short", 5);
+	EXPECT_EQ(data, sky.loadEquirectangularData(cache_dir, width, height));
+	EXPECT_EQ(data, sky.loadEquirectangularData(cache_dir, width, height));
+
+	// Different sky, different file.
+	sky.setSunDirection(Eigen::Vector3f(0, 1, 1));
+	EXPECT_NE(path, sky.getCachePath(cache_dir, width, height));
+
+	// Failing to store (cache_dir can't be created under a file) still
+	// gives data.
+	const std::string bad_dir = path + "/cache";
+	EXPECT_EQ(sky.generateEquirectangularData(width, height),
+		sky.loadEquirectangularData(bad_dir, width, height));
+
+	std::remove(path.c_str());
+	rmdir(cache_dir.c_str());
+	rmdir(temp_dir.c_str());
+}
+
+TEST(SkyTest, TablesSameAsReference) {
+	Sky sky;
+	std::mt19937 random(1);
+	for(const auto& sun : {Eigen::Vector3f(0, 20, 1), Eigen::Vector3f(1, 0, 1), Eigen::Vector3f(0, 0, 1)}) {
+		sky.setSunDirection(sun);
+		for(int i = 0; i < 100; i++) {
+			const auto dir = sample_hemisphere(random, Eigen::Vector3f::UnitZ());
+			const float theta = std::acos(dir.z());
+			const float phi = std::atan2(dir.y(), dir.x());
+
+			const Colorf expected = sky.getRadianceAtReference(theta, phi);
+			const Colorf actual = sky.getRadianceAt(dir);
+			for(int c = 0; c < 3; c++) {
+				EXPECT_NEAR(expected[c], actual[c], expected[c] * 0.01);
+			}
+		}
+	}
+}
+
+TEST(SkyTest, BatchSameAsSingle) {
+	Sky sky;
+	std::mt19937 random(1);
+	std::vector<Eigen::Vector3f> dirs;
+	for(int i = 0; i < 100; i++) {
+		dirs.push_back(sample_hemisphere(random, Eigen::Vector3f(0.3, 0.1, 1).normalized()));
+	}
+
+	const auto radiances = sky.getRadianceAt(dirs);
+	ASSERT_EQ(dirs.size(), radiances.size());
+	for(int i = 0; i < dirs.size(); i++) {
+		const Colorf expected = sky.getRadianceAt(dirs[i]);
+		for(int c = 0; c < 3; c++) {
+			EXPECT_NEAR(expected[c], radiances[i][c], expected[c] * 1e-4 + 1e-5);
+		}
+	}
+}
+
+TEST(IrradianceBakeTest, RestoresUnchangedGroups) {
+	std::mt19937 random(1);
+	auto tris = generateRandomTriangles(30, random);
+	for(int i = 0; i < tris.size(); i++) {
+		for(int k = 0; k < 3; k++) {
+			tris[i].setIrradiance(k, Colorf(i, k, 1));
+		}
+	}
+	std::vector<bool> converged(3 * tris.size());
+	for(int i = 0; i < converged.size(); i++) {
+		converged[i] = i % 4 == 0;
+	}
+	const std::string temp_dir = createTempDir();
+	const std::string path = temp_dir + "/irradiance.bin";
+	const uint32_t sky_hash = Sky().getParameterHash();
+	IrradianceBake::save(path, sky_hash, tris, converged, {{0, 10}, {10, 20}});
+
+	// Move the 2nd group.
+	auto tris_loaded = tris;
+	for(auto& tri : tris_loaded) {
+		for(int k = 0; k < 3; k++) {
+			tri.setIrradiance(k, Colorf(0, 0, 0));
+		}
+	}
+	tris_loaded[15].p0 += Eigen::Vector3f(0.1, 0, 0);
+
+	IrradianceBake bake(path, sky_hash);
+	std::vector<bool> converged_loaded;
+	EXPECT_EQ(2, bake.getNumEntries());
+	EXPECT_TRUE(bake.apply(tris_loaded, 0, 10, converged_loaded));
+	EXPECT_EQ(std::vector<bool>(converged.begin(), converged.begin() + 30), converged_loaded);
+	EXPECT_FALSE(bake.apply(tris_loaded, 10, 20, converged_loaded));
+	for(int i = 0; i < 10; i++) {
+		for(int k = 0; k < 3; k++) {
+			EXPECT_EQ(tris[i].getIrradiance(k), tris_loaded[i].getIrradiance(k));
+		}
+	}
+	EXPECT_EQ(Colorf(0, 0, 0), tris_loaded[10].getIrradiance(0));
+
+	// Lit under another sky.
+	Sky sky_moved;
+	sky_moved.setSunDirection(Eigen::Vector3f(1, 0, 1));
+	ASSERT_NE(sky_hash, sky_moved.getParameterHash());
+	IrradianceBake bake_stale(path, sky_moved.getParameterHash());
+	EXPECT_EQ(0, bake_stale.getNumEntries());
+	EXPECT_FALSE(bake_stale.apply(tris_loaded, 0, 10, converged_loaded));
+	std::remove(path.c_str());
+
+	// Missing file is just empty.
+	IrradianceBake bake_missing(path, sky_hash);
+	EXPECT_EQ(0, bake_missing.getNumEntries());
+	EXPECT_FALSE(bake_missing.apply(tris_loaded, 0, 10, converged_loaded));
+
+	// Failed writes leave nothing behind.
+	const std::string path_bad = temp_dir + "/missing/irradiance.bin";
+	EXPECT_ANY_THROW(IrradianceBake::save(path_bad, sky_hash, tris, converged, {{0, 10}}));
+	EXPECT_FALSE(std::ifstream(path_bad + ".tmp"));
+	rmdir(temp_dir.c_str());
+}
+
+TEST(LightingTest, StopsWhenConverged) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	auto scene = std::make_shared<LightingScene>();
+	scene->tris.emplace_back(
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(1, -1, 0), Eigen::Vector3f(-1, 1, 0));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, -1, 0));
+	scene->bvh.setObject(0, scene->tris, 0, 2);
+	scene->bvh.buildTop();
+	scene->active.resize(2, true);
+	scene->buildMesh();
+	lighting.setScene(scene);
+
+	std::shared_ptr<const LightingResult> result;
+	for(int i = 0; i < 1000; i++) {
+		result = lighting.getResult();
+		if(result && result->converged) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	ASSERT_TRUE(result);
+	ASSERT_TRUE(result->converged);
+
+	// Nothing is published while idle.
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	EXPECT_EQ(result, lighting.getResult());
+}
+
+// Add a quad (p0, p0 + e0, p0 + e1, p0 + e0 + e1) facing e0 x e1 to
+// scene as object id. Call finishScene after adding everything.
+void addQuad(LightingScene& scene, ObjectId id,
+	Eigen::Vector3f p0, Eigen::Vector3f e0, Eigen::Vector3f e1) {
+	const int first = scene.tris.size();
+	scene.tris.emplace_back(p0, p0 + e0, p0 + e1);
+	scene.tris.emplace_back(p0 + e0 + e1, p0 + e1, p0 + e0);
+	scene.bvh.setObject(id, scene.tris, first, 2);
+	scene.active.resize(scene.tris.size(), true);
+}
+
+void finishScene(LightingScene& scene) {
+	scene.bvh.buildTop();
+	scene.buildMesh();
+}
+
+// Wait until lighting publishes a converged result for scene.
+std::shared_ptr<const LightingResult> waitConverged(Lighting& lighting,
+	std::shared_ptr<const LightingScene> scene) {
+	for(int i = 0; i < 1000; i++) {
+		auto result = lighting.getResult();
+		if(result && result->scene == scene && result->converged) {
+			return result;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return nullptr;
+}
+
+TEST(LightingTest, PublishesResultWhenChangeIsUnseen) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	// Floor, and a tiny tile far behind it (w.r.t. the Sun).
+	auto scene = std::make_shared<LightingScene>();
+	addQuad(*scene, 0, Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	addQuad(*scene, 1, Eigen::Vector3f(0, -50, 0), Eigen::Vector3f(0.2, 0, 0), Eigen::Vector3f(0, 0.2, 0));
+	finishScene(*scene);
+	lighting.setScene(scene);
+	auto result = waitConverged(lighting, scene);
+	ASSERT_TRUE(result);
+
+	// Remove the tile; nothing needs lighting.
+	auto scene_removed = std::make_shared<LightingScene>(*scene);
+	scene_removed->active[2] = false;
+	scene_removed->active[3] = false;
+	scene_removed->bvh.removeObject(1);
+	finishScene(*scene_removed);
+	scene_removed->version = scene->version + 1;
+	scene_removed->base_version = scene->version;
+	scene_removed->changed_bounds = {Eigen::AlignedBox3f(
+		Eigen::Vector3f(0, -50, 0), Eigen::Vector3f(0.2, -49.8, 0))};
+	lighting.setScene(scene_removed);
+
+	auto result_removed = waitConverged(lighting, scene_removed);
+	ASSERT_TRUE(result_removed);
+	ASSERT_EQ(4, scene_removed->vertices.size());
+	for(int i = 0; i < 4; i++) {
+		ASSERT_EQ(scene->vertices[i].pos, scene_removed->vertices[i].pos);
+		EXPECT_EQ(result->irradiance[i], result_removed->irradiance[i]);
+	}
+}
+
+TEST(LightingTest, RelightsOnlyVerticesThatSeeChange) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	// Two floors far apart.
+	auto scene = std::make_shared<LightingScene>();
+	addQuad(*scene, 0, Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	addQuad(*scene, 1, Eigen::Vector3f(49, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	finishScene(*scene);
+	lighting.setScene(scene);
+	auto result = waitConverged(lighting, scene);
+	ASSERT_TRUE(result);
+
+	// Put a roof (facing down) over the first floor.
+	auto scene_roofed = std::make_shared<LightingScene>(*scene);
+	addQuad(*scene_roofed, 2, Eigen::Vector3f(-1.5, -1.5, 0.3), Eigen::Vector3f(0, 3, 0), Eigen::Vector3f(3, 0, 0));
+	finishScene(*scene_roofed);
+	scene_roofed->version = scene->version + 1;
+	scene_roofed->base_version = scene->version;
+	scene_roofed->changed_bounds = {Eigen::AlignedBox3f(
+		Eigen::Vector3f(-1.5, -1.5, 0.3), Eigen::Vector3f(1.5, 1.5, 0.3))};
+	lighting.setScene(scene_roofed);
+	for(int i = 0; i < 8; i++) {
+		ASSERT_EQ(scene->vertices[i].pos, scene_roofed->vertices[i].pos);
+	}
+
+	// Wait until the first floor is re-lit in the shade. (this geometry is
+	// too noisy to wait for convergence)
+	auto is_shaded = [&](const LightingResult& result_roofed) {
+		for(int i = 0; i < 4; i++) {
+			if(result_roofed.irradiance[i].mean() > result->irradiance[i].mean() * 0.8) {
+				return false;
+			}
+		}
+		return true;
+	};
+	std::shared_ptr<const LightingResult> result_roofed;
+	for(int i = 0; i < 1000; i++) {
+		result_roofed = lighting.getResult();
+		if(result_roofed->scene == scene_roofed && is_shaded(*result_roofed)) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	ASSERT_EQ(scene_roofed, result_roofed->scene);
+	EXPECT_TRUE(is_shaded(*result_roofed));
+
+	// The second floor is kept as is.
+	for(int i = 4; i < 8; i++) {
+		EXPECT_EQ(result->irradiance[i], result_roofed->irradiance[i]);
+	}
+}
+
+// Change adding a quad as object id at slots [first, first + 2). See addQuad.
+LightingChange createQuadChange(ObjectId id, int first,
+	Eigen::Vector3f p0, Eigen::Vector3f e0, Eigen::Vector3f e1) {
+	LightingChange change;
+	change.id = id;
+	change.first = first;
+	change.tris.emplace_back(p0, p0 + e0, p0 + e1);
+	change.tris.emplace_back(p0 + e0 + e1, p0 + e1, p0 + e0);
+	return change;
+}
+
+// Wait until lighting publishes a converged result with n_updates applied.
+std::shared_ptr<const LightingResult> waitUpdated(Lighting& lighting, int n_updates) {
+	for(int i = 0; i < 1000; i++) {
+		auto result = lighting.getResult();
+		if(result && result->scene->n_updates == n_updates && result->converged) {
+			return result;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return nullptr;
+}
+
+TEST(LightingTest, BuildsSceneFromUpdates) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	// Floor and a tile far from it, in separate updates.
+	lighting.updateGeometry({createQuadChange(0, 0,
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0))});
+	lighting.updateGeometry({createQuadChange(1, 2,
+		Eigen::Vector3f(10, 0, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0))});
+	auto result = waitUpdated(lighting, 2);
+	ASSERT_TRUE(result);
+	EXPECT_EQ(8, result->scene->vertices.size());
+	EXPECT_EQ(std::vector<bool>({true, true, true, true}), result->scene->active);
+
+	// Remove the floor; the tile can't see it, and keeps its irradiance.
+	LightingChange removal;
+	removal.id = 0;
+	removal.first_old = 0;
+	removal.count_old = 2;
+	removal.removed = true;
+	lighting.updateGeometry({removal});
+	auto result_removed = waitUpdated(lighting, 3);
+	ASSERT_TRUE(result_removed);
+	const LightingScene& scene_removed = *result_removed->scene;
+	EXPECT_EQ(result->scene->version, scene_removed.base_version);
+	EXPECT_EQ(std::vector<bool>({false, false, true, true}), scene_removed.active);
+	ASSERT_EQ(4, scene_removed.vertices.size());
+	for(int i = 0; i < 4; i++) {
+		EXPECT_EQ(result->scene->vertices[4 + i].pos, scene_removed.vertices[i].pos);
+		EXPECT_EQ(result->irradiance[4 + i], result_removed->irradiance[i]);
+	}
+}
+
+// Send a floor (object 0) and a tile (object 1), then load them again with
+// the floor baked as converged and the tile missing in the bake.
+// Return the result after loading.
+std::shared_ptr<const LightingResult> loadBakedFloor(Lighting& lighting,
+	Eigen::Vector3f tile_p0, Eigen::Vector3f tile_e0, Eigen::Vector3f tile_e1) {
+	auto floor = createQuadChange(0, 0,
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	auto tile = createQuadChange(1, 2, tile_p0, tile_e0, tile_e1);
+	lighting.updateGeometry({floor, tile});
+
+	for(auto& tri : floor.tris) {
+		for(int k = 0; k < 3; k++) {
+			tri.setIrradiance(k, Colorf(100, 100, 100));
+		}
+	}
+	floor.first_old = 0;
+	floor.count_old = 2;
+	floor.baked = true;
+	floor.converged.assign(6, true);
+	tile.first_old = 2;
+	tile.count_old = 2;
+	lighting.updateGeometry({floor, tile});
+
+	for(int i = 0; i < 1000; i++) {
+		auto result = lighting.getResult();
+		if(result && result->scene->n_updates == 2) {
+			return result;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return nullptr;
+}
+
+TEST(LightingTest, KeepsConvergedBakedVertices) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	// The floor can't see the tile, so it's never relit.
+	auto result = loadBakedFloor(lighting,
+		Eigen::Vector3f(10, 0, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0));
+	ASSERT_TRUE(result);
+	ASSERT_EQ(8, result->scene->vertices.size());
+	for(int i = 0; i < 4; i++) {
+		EXPECT_TRUE(result->vertex_converged[i]);
+	}
+	auto result_converged = waitUpdated(lighting, 2);
+	ASSERT_TRUE(result_converged);
+	for(int i = 0; i < 4; i++) {
+		EXPECT_EQ(Colorf(100, 100, 100), result_converged->irradiance[i]);
+	}
+}
+
+TEST(LightingTest, RelightsBakedVerticesThatSeeUnbaked) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	// A roof (facing down) over the floor.
+	auto result = loadBakedFloor(lighting,
+		Eigen::Vector3f(-1.5, -1.5, 0.3), Eigen::Vector3f(0, 3, 0), Eigen::Vector3f(3, 0, 0));
+	ASSERT_TRUE(result);
+	for(int i = 0; i < 1000 && result->irradiance[0] == Colorf(100, 100, 100); i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		result = lighting.getResult();
+	}
+	EXPECT_NE(Colorf(100, 100, 100), result->irradiance[0]);
+}
+
+TEST(LightingTest, ResultsListUpdatedVertices) {
+	Sky sky;
+	Lighting lighting(std::make_shared<SkyRadianceMap>(sky, 32), 2);
+
+	auto scene = std::make_shared<LightingScene>();
+	addQuad(*scene, 0, Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	addQuad(*scene, 1, Eigen::Vector3f(5, -1, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0));
+	finishScene(*scene);
+	lighting.setScene(scene);
+
+	// Follow results like the render thread, copying only updated vertices
+	// when possible. Results are often skipped.
+	std::shared_ptr<const LightingResult> applied;
+	std::vector<Colorf> irradiance;
+	int n_incremental = 0;
+	for(int i = 0; i < 2000 && !(applied && applied->converged); i++) {
+		auto result = lighting.getResult();
+		if(result && result != applied) {
+			EXPECT_TRUE(std::is_sorted(result->updated.begin(), result->updated.end()));
+			if(applied && result->base_serial <= applied->serial) {
+				for(int vertex : result->updated) {
+					irradiance[vertex] = result->irradiance[vertex];
+				}
+				n_incremental++;
+			} else {
+				irradiance = result->irradiance;
+			}
+			applied = result;
+			lighting.acknowledgeResult(result->serial);
+			ASSERT_EQ(result->irradiance, irradiance);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	ASSERT_TRUE(applied);
+	EXPECT_TRUE(applied->converged);
+	EXPECT_LT(0, n_incremental);
+}
+
+TEST(LightingTest, ParallelSameAsSingleThread) {
+	Sky sky;
+	auto sky_map = std::make_shared<SkyRadianceMap>(sky, 32);
+
+	// Two floors; more vertices than threads.
+	auto scene = std::make_shared<LightingScene>();
+	addQuad(*scene, 0, Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(2, 0, 0), Eigen::Vector3f(0, 2, 0));
+	addQuad(*scene, 1, Eigen::Vector3f(5, -1, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0));
+	finishScene(*scene);
+
+	Lighting lighting_single(sky_map, 1);
+	Lighting lighting_parallel(sky_map, 4);
+	lighting_single.setScene(scene);
+	lighting_parallel.setScene(scene);
+	auto result_single = waitConverged(lighting_single, scene);
+	auto result_parallel = waitConverged(lighting_parallel, scene);
+	ASSERT_TRUE(result_single);
+	ASSERT_TRUE(result_parallel);
+
+	// Samples only depend on the vertex and its visits.
+	ASSERT_EQ(8, scene->vertices.size());
+	for(int i = 0; i < scene->vertices.size(); i++) {
+		EXPECT_EQ(result_single->irradiance[i], result_parallel->irradiance[i]);
+	}
+}
+
+TEST(LightingTest, RadiositySameAsGather) {
+	Sky sky;
+	auto sky_map = std::make_shared<SkyRadianceMap>(sky, 32);
+
+	// Floor and a wall facing each other, to have some bounce.
+	auto scene = std::make_shared<LightingScene>();
+	scene->tris.emplace_back(
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(1, -1, 0), Eigen::Vector3f(-1, 1, 0));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, -1, 0));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 2));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(1, 1, 2), Eigen::Vector3f(-1, 1, 2), Eigen::Vector3f(1, 1, 0));
+	scene->bvh.setObject(0, scene->tris, 0, 4);
+	scene->bvh.buildTop();
+	scene->active.resize(4, true);
+	scene->buildMesh();
+
+	// GATHER keeps fluctuating around the answer in corners (moving average
+	// of noisy estimates), so average its results over a while.
+	std::vector<Colorf> gathered(scene->vertices.size(), Colorf(0, 0, 0));
+	{
+		Lighting lighting(sky_map, 2, GATHER);
+		lighting.setScene(scene);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+		const int n_snapshots = 100;
+		for(int k = 0; k < n_snapshots; k++) {
+			auto result = lighting.getResult();
+			ASSERT_TRUE(result);
+			for(int i = 0; i < gathered.size(); i++) {
+				gathered[i] += result->irradiance[i] / n_snapshots;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	Lighting lighting(sky_map, 2, RADIOSITY);
+	lighting.setScene(scene);
+	auto result = waitConverged(lighting, scene);
+	ASSERT_TRUE(result);
+
+	for(int i = 0; i < scene->vertices.size(); i++) {
+		const float expected = gathered[i].mean();
+		EXPECT_NEAR(expected, result->irradiance[i].mean(), expected * 0.15);
+	}
+}
+
+TEST(RadiosityTest, SubdivisionKeepsOldRows) {
+	Sky sky;
+	SkyRadianceMap sky_map(sky, 32);
+
+	// Floor and a wall.
+	auto scene = std::make_shared<LightingScene>();
+	scene->tris.emplace_back(
+		Eigen::Vector3f(-1, -1, 0), Eigen::Vector3f(1, -1, 0), Eigen::Vector3f(-1, 1, 0));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, -1, 0));
+	scene->tris.emplace_back(
+		Eigen::Vector3f(-1, 1, 0), Eigen::Vector3f(1, 1, 0), Eigen::Vector3f(-1, 1, 2));
+	scene->bvh.setObject(0, scene->tris, 0, 3);
+	scene->bvh.buildTop();
+	scene->active.resize(3, true);
+	scene->buildMesh();
+
+	auto scene_refined = std::make_shared<LightingScene>(*scene);
+	std::vector<Colorf> irradiance(scene->vertices.size(), Colorf(1, 1, 1));
+	irradiance[scene->corners[0][0]] = Colorf(10, 10, 10);
+	ASSERT_LT(0, scene_refined->subdivide(irradiance, 1000));
+
+	// Solve F of both, from the same state.
+	auto solve = [&](const Radiosity& radiosity) {
+		std::vector<Colorf> irradiance(scene_refined->vertices.size(), Colorf(0, 0, 0));
+		for(int i = 0; i < 1000 && radiosity.iterate(irradiance) > 1e-4; i++) {
+		}
+		return irradiance;
+	};
+	Radiosity base(scene, 256, 2);
+	Radiosity reused(base, scene_refined);
+	reused.setSky(sky_map);
+	Radiosity rebuilt(scene_refined, 256, 2);
+	rebuilt.setSky(sky_map);
+	const auto irradiance_reused = solve(reused);
+	const auto irradiance_rebuilt = solve(rebuilt);
+
+	for(int i = 0; i < scene_refined->vertices.size(); i++) {
+		const float expected = irradiance_rebuilt[i].mean();
+		EXPECT_LT(0, expected);
+		EXPECT_NEAR(expected, irradiance_reused[i].mean(), expected * 0.15);
+	}
+}
+
+TEST(TriangleSlotsTest, ReusesFreedSlots) {
+	TriangleSlots slots;
+	EXPECT_EQ(0, slots.allocate(2));
+	EXPECT_EQ(2, slots.allocate(4));
+	EXPECT_EQ(6, slots.allocate(2));
+	EXPECT_EQ(8, slots.size());
+
+	// Too small for 4 until merged with the neighbor.
+	slots.free(0, 2);
+	EXPECT_EQ(8, slots.allocate(4));
+	slots.free(2, 4);
+	EXPECT_EQ(0, slots.allocate(6));
+	EXPECT_EQ(12, slots.size());
+
+	// First fit leaves the rest free.
+	slots.free(6, 2);
+	slots.free(8, 4);
+	EXPECT_EQ(6, slots.allocate(1));
+	EXPECT_EQ(7, slots.allocate(5));
+	EXPECT_EQ(12, slots.size());
+}
+
+// Same allocation and changes as Scene::updateGeometry, for n_quads unit quads
+// in a row at x.
+LightingChange createTilesChange(TriangleSlots& slots, ObjectId id, float x, int n_quads) {
+	LightingChange change;
+	change.id = id;
+	for(int i = 0; i < n_quads; i++) {
+		auto quad = createQuadChange(id, 0,
+			Eigen::Vector3f(x + i, 0, 0), Eigen::Vector3f(1, 0, 0), Eigen::Vector3f(0, 1, 0));
+		change.tris.insert(change.tris.end(), quad.tris.begin(), quad.tris.end());
+	}
+	change.first = slots.allocate(change.tris.size());
+	return change;
+}
+
+LightingChange moveChange(TriangleSlots& slots, const LightingChange& old_change,
+	float x, int n_quads) {
+	slots.free(old_change.first, old_change.tris.size());
+	auto change = createTilesChange(slots, old_change.id, x, n_quads);
+	change.first_old = old_change.first;
+	change.count_old = old_change.tris.size();
+	return change;
+}
+
+LightingChange removeChange(TriangleSlots& slots, const LightingChange& old_change) {
+	slots.free(old_change.first, old_change.tris.size());
+	LightingChange change;
+	change.id = old_change.id;
+	change.first_old = old_change.first;
+	change.count_old = old_change.tris.size();
+	change.removed = true;
+	return change;
+}
+
+Eigen::AlignedBox3f tilesBounds(float x, int n_quads) {
+	return Eigen::AlignedBox3f(Eigen::Vector3f(x, 0, 0), Eigen::Vector3f(x + n_quads, 1, 0));
+}
+
+void expectSameBounds(const std::vector<Eigen::AlignedBox3f>& expected,
+	const std::vector<Eigen::AlignedBox3f>& actual) {
+	ASSERT_EQ(expected.size(), actual.size());
+	for(int i = 0; i < expected.size(); i++) {
+		EXPECT_TRUE(expected[i].isApprox(actual[i])) << "bounds " << i;
+	}
+}
+
+// First slot of the quad hit by a ray down onto (x + 0.5, 0.5), -1 when missed.
+int hitTilesAt(const LightingScene& scene, float x) {
+	const int index = scene.bvh.closestHit(
+		Ray(Eigen::Vector3f(x + 0.5, 0.5, 1), Eigen::Vector3f(0, 0, -1))).index;
+	return (index < 0) ? -1 : index - index % 2;
+}
+
+TEST(LightingSceneTest, AppliesChangesToSlots) {
+	TriangleSlots slots;
+	const auto a = createTilesChange(slots, 0, 0, 1);
+	const auto b = createTilesChange(slots, 1, 10, 2);
+	const auto c = createTilesChange(slots, 2, 20, 1);
+	const LightingScene scene0(LightingScene(), {a, b, c});
+	EXPECT_EQ(std::vector<bool>(8, true), scene0.active);
+	EXPECT_EQ(3, scene0.changed_bounds.size());
+
+	// Remove b, and grow a into slots of both.
+	const auto b_removed = removeChange(slots, b);
+	const auto a_grown = moveChange(slots, a, 5, 2);
+	EXPECT_EQ(0, a_grown.first);
+	const LightingScene scene1(scene0, {b_removed, a_grown});
+	EXPECT_EQ(8, scene1.tris.size());
+	EXPECT_EQ(std::vector<bool>({true, true, true, true, false, false, true, true}),
+		scene1.active);
+	expectSameBounds({tilesBounds(10, 2), tilesBounds(0, 1), tilesBounds(5, 2)},
+		scene1.changed_bounds);
+
+	// Inactive slots still hold b, but the bvh doesn't.
+	EXPECT_EQ(-1, hitTilesAt(scene1, 10));
+	EXPECT_EQ(-1, hitTilesAt(scene1, 11));
+	EXPECT_EQ(-1, hitTilesAt(scene1, 0));
+	EXPECT_EQ(0, hitTilesAt(scene1, 5));
+	EXPECT_EQ(2, hitTilesAt(scene1, 6));
+	EXPECT_EQ(6, hitTilesAt(scene1, 20));
+	for(int i = 0; i < scene1.corners.size(); i++) {
+		EXPECT_EQ(scene1.active[i], scene1.corners[i][0] >= 0);
+	}
+
+	// Re-add b smaller; it goes to the freed slots without growing tris.
+	const auto b_readded = createTilesChange(slots, 1, 10, 1);
+	EXPECT_EQ(4, b_readded.first);
+	const LightingScene scene2(scene1, {b_readded});
+	EXPECT_EQ(8, scene2.tris.size());
+	EXPECT_EQ(std::vector<bool>(8, true), scene2.active);
+	expectSameBounds({tilesBounds(10, 1)}, scene2.changed_bounds);
+	EXPECT_EQ(4, hitTilesAt(scene2, 10));
+	EXPECT_EQ(-1, hitTilesAt(scene2, 11));
+}
+
+TEST(UITransformTest, DirtyOnlyWhenMatrixChanges) {
+	UITransform trans;
+	EXPECT_TRUE(trans.dirty);
+
+	trans.dirty = false;
+	trans.set(Transform3f::Identity());
+	EXPECT_FALSE(trans.dirty);
+
+	const Transform3f moved(Eigen::Translation<float, 3>(1, 0, 0));
+	trans.set(moved);
+	EXPECT_TRUE(trans.dirty);
+	EXPECT_EQ(moved.matrix(), trans.get().matrix());
+
+	trans.dirty = false;
+	trans.set(moved);
+	EXPECT_FALSE(trans.dirty);
+}
+
+// 4x4 square on z = 0 centered at the origin, in PosUV format.
+std::vector<float> createSquarePosUV() {
+	return {
+		-2, -2, 0, 0, 0,   2, -2, 0, 1, 0,   2, 2, 0, 1, 1,
+		-2, -2, 0, 0, 0,   2, 2, 0, 1, 1,   -2, 2, 0, 0, 1};
+}
+
+void expectSameAsFreshBVH(const UIGeometry& ui) {
+	BVH bvh;
+	bvh.build(ui.tris);
+
+	// Squares face +z.
+	std::mt19937 random;
+	std::uniform_real_distribution<float> pos(-6, 6);
+	int n_hits = 0;
+	for(int i = 0; i < 500; i++) {
+		const Ray ray(Eigen::Vector3f(pos(random), pos(random), 5),
+			sample_hemisphere(random, -Eigen::Vector3f::UnitZ()));
+		auto isect_ref = bvh.intersect(ui.tris, ray);
+		auto isect = ui.intersect(ray);
+
+		ASSERT_EQ(static_cast<bool>(isect_ref), static_cast<bool>(isect));
+		if(isect_ref) {
+			EXPECT_EQ(isect_ref->id, isect->id);
+			EXPECT_FLOAT_EQ(isect_ref->t, isect->t);
+			n_hits++;
+		}
+	}
+	EXPECT_LT(10, n_hits);
+}
+
+// id of UI object hit by a ray down onto (x, y), -1 when missed.
+int hitUIAt(const UIGeometry& ui, float x, float y) {
+	auto isect = ui.intersect(Ray(Eigen::Vector3f(x, y, 10), Eigen::Vector3f(0, 0, -1)));
+	return isect ? isect->id : -1;
+}
+
+TEST(UIGeometryTest, RefitsWhenOnlyMoved) {
+	const auto square = createSquarePosUV();
+	UITransform trans0;
+	UITransform trans1;
+	trans0.set(Transform3f(Eigen::Translation<float, 3>(-3, 0, 0)));
+	trans1.set(Transform3f(Eigen::Translation<float, 3>(3, 0, 0)));
+
+	UIGeometry ui;
+	ui.add(0, nullptr, square, trans0);
+	ui.add(1, nullptr, square, trans1);
+	EXPECT_EQ(UI_UPDATE_BUILD, ui.update());
+	EXPECT_FALSE(trans0.dirty);
+	EXPECT_FALSE(trans1.dirty);
+	EXPECT_EQ(0, hitUIAt(ui, -3, 0));
+	EXPECT_EQ(1, hitUIAt(ui, 3, 0));
+
+	// Setting the same transform (as scripts do every frame) isn't a move.
+	trans1.set(Transform3f(Eigen::Translation<float, 3>(3, 0, 0)));
+	ui.add(0, nullptr, square, trans0);
+	ui.add(1, nullptr, square, trans1);
+	EXPECT_EQ(UI_UPDATE_NONE, ui.update());
+
+	trans0.set(Transform3f(Eigen::Translation<float, 3>(-3, 3, 1)));
+	ui.add(0, nullptr, square, trans0);
+	ui.add(1, nullptr, square, trans1);
+	EXPECT_EQ(UI_UPDATE_REFIT, ui.update());
+	EXPECT_FALSE(trans0.dirty);
+	EXPECT_EQ(-1, hitUIAt(ui, -3, -1.5));
+	EXPECT_EQ(0, hitUIAt(ui, -3, 4.5));
+	expectSameAsFreshBVH(ui);
+
+	// Removing an object changes the structure.
+	ui.add(0, nullptr, square, trans0);
+	EXPECT_EQ(UI_UPDATE_BUILD, ui.update());
+	EXPECT_EQ(2, ui.tris.size());
+	EXPECT_EQ(-1, hitUIAt(ui, 3, 0));
+	expectSameAsFreshBVH(ui);
+}
+
+TEST(IrradianceTexelsTest, IndexesTexelsByVertex) {
+	// Vertex 0, midpoint of vertices 1 & 2, and black.
+	IrradianceTexels texels;
+	texels.addTerm(0, 1);
+	texels.endTexel();
+	texels.addTerm(1, 0.5);
+	texels.addTerm(2, 0.5);
+	texels.endTexel();
+	texels.endTexel();
+	texels.buildIndex(4);
+	ASSERT_EQ(3, texels.size());
+
+	const std::vector<Colorf> irradiance = {
+		Colorf(1, 1, 1), Colorf(2, 2, 2), Colorf(4, 4, 4), Colorf(8, 8, 8)};
+	EXPECT_EQ(Colorf(1, 1, 1), texels.getIrradiance(0, irradiance));
+	EXPECT_EQ(Colorf(3, 3, 3), texels.getIrradiance(1, irradiance));
+	EXPECT_EQ(Colorf(0, 0, 0), texels.getIrradiance(2, irradiance));
+
+	std::vector<int> texels_of_2;
+	texels.appendTexels(2, texels_of_2);
+	EXPECT_EQ(std::vector<int>({1}), texels_of_2);
+	std::vector<int> texels_of_3;
+	texels.appendTexels(3, texels_of_3);
+	EXPECT_TRUE(texels_of_3.empty());
+}
+
+TEST(RenderItemTest, OrdersByPassStateAndDepth) {
+	// GL names; no context needed.
+	const GLuint shader = 3;
+	auto create = [&](RenderItem::Pass pass, GLuint texture, float depth) {
+		RenderItem item;
+		item.pass = pass;
+		item.shader = shader;
+		item.texture = texture;
+		item.depth = depth;
+		item.object = nullptr;
+		return item;
+	};
+	const GLuint tex_a = 1;
+	const GLuint tex_b = 2;
+
+	// Opaque: same texture together, then front to back.
+	EXPECT_LT(create(RenderItem::OPAQUE, tex_a, 5).getKey(), create(RenderItem::OPAQUE, tex_a, 10).getKey());
+	EXPECT_LT(create(RenderItem::OPAQUE, tex_a, 10).getKey(), create(RenderItem::OPAQUE, tex_b, 5).getKey());
+
+	// Sky: after every opaque item, whatever its texture.
+	EXPECT_LT(create(RenderItem::OPAQUE, tex_b, 1e6).getKey(), create(RenderItem::SKY, tex_a, 0).getKey());
+
+	// Blended: after sky, back to front regardless of texture.
+	EXPECT_LT(create(RenderItem::SKY, tex_b, 0).getKey(), create(RenderItem::BLENDED, tex_a, 1).getKey());
+	EXPECT_LT(create(RenderItem::BLENDED, tex_b, 10).getKey(), create(RenderItem::BLENDED, tex_a, 5).getKey());
+
+	// Cursor is always last.
+	EXPECT_LT(create(RenderItem::BLENDED, tex_a, 0).getKey(), create(RenderItem::CURSOR, tex_a, 100).getKey());
+}
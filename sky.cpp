@@ -1,8 +1,14 @@
 #include "sky.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <thread>
 
 #include <eigen3/Eigen/Dense>
+#include <sys/stat.h>
 
 
 namespace construct {
@@ -15,39 +21,142 @@ Sky::Sky() {
 	sun_direction.normalize();
 
 	sun_power = Colorf(150e3, 150e3, 150e3);  // lx
+
+	rayleigh_total = rayleighTotal();
+	mie_total = mieTotal();
+	buildTables();
+}
+
+void Sky::setSunDirection(Eigen::Vector3f dir) {
+	sun_direction = dir.normalized();
 }
 
-std::shared_ptr<Texture> Sky::generateEquirectangular() {
+std::shared_ptr<Texture> Sky::generateEquirectangular(const std::string& cache_dir) {
 	const int height = 256;
 	const int width = height * 2;
+	const auto data = loadEquirectangularData(cache_dir, width, height);
+
 	auto texture = Texture::create(width, height, true);
+	texture->useIn();
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, data.data());
+	return texture;
+}
 
+std::vector<float> Sky::loadEquirectangularData(const std::string& cache_dir, int width, int height) const {
+	if(cache_dir.empty()) {
+		return generateEquirectangularData(width, height);
+	}
+
+	// Cache file is raw floats; its name encodes everything else.
 	std::vector<float> data(width * height * 3, 0);
-	for(int y = 0; y < height; y++) {
-		for(int x = 0; x < width; x++) {
-			const float theta = pi * static_cast<float>(y) / height;
-			const float phi = 2 * pi * static_cast<float>(x) / width;
+	const std::string path = getCachePath(cache_dir, width, height);
+	std::ifstream ifs(path, std::ios::binary);
+	if(ifs.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float))) {
+		return data;
+	}
+	data = generateEquirectangularData(width, height);
+
+	// Failing to store is fine; we'll just generate again next time.
+	mkdir(cache_dir.c_str(), 0755);
+	const std::string path_temp = path + ".tmp";
+	std::ofstream ofs(path_temp, std::ios::binary);
+	ofs.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+	ofs.close();
+
+	// Make it atomic, so that other processes never see a partial file.
+	// A short write (e.g. disk full) must never become the cache.
+	if(ofs) {
+		std::rename(path_temp.c_str(), path.c_str());
+	} else {
+		std::remove(path_temp.c_str());
+	}
+	return data;
+}
 
-			const Colorf radiance = getRadianceAt(theta, phi, false);
+std::vector<float> Sky::generateEquirectangularData(int width, int height) const {
+	std::vector<float> data(width * height * 3, 0);
+	auto worker = [&](int y_begin, int y_step) {
+		std::vector<Eigen::Vector3f> dirs(width);
+		for(int y = y_begin; y < height; y += y_step) {
+			for(int x = 0; x < width; x++) {
+				const float theta = pi * static_cast<float>(y) / height;
+				const float phi = 2 * pi * static_cast<float>(x) / width;
+				dirs[x] = Eigen::Vector3f(
+					std::sin(theta) * std::cos(phi),
+					std::sin(theta) * std::sin(phi),
+					std::cos(theta));
+			}
 
-			for(int channel = 0; channel < 3; channel++) {
-				data[(y * width + x) * 3 + channel] = radiance[channel];
+			const auto radiances = getRadianceAt(dirs);
+			for(int x = 0; x < width; x++) {
+				for(int channel = 0; channel < 3; channel++) {
+					data[(y * width + x) * 3 + channel] = radiances[x][channel];
+				}
 			}
 		}
+	};
+
+	// Interleave rows, since cost differs between upper & lower hemisphere.
+	const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> threads;
+	for(int i = 1; i < n_threads; i++) {
+		threads.emplace_back(worker, i, n_threads);
 	}
+	worker(0, n_threads);
+	for(auto& thread : threads) {
+		thread.join();
+	}
+	return data;
+}
 
-	texture->useIn();
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, data.data());
-	return texture;
+// FNV-1a
+void feedHash(uint32_t& hash, const void* p, int size) {
+	for(int i = 0; i < size; i++) {
+		hash ^= static_cast<const uint8_t*>(p)[i];
+		hash *= 16777619u;
+	}
+}
+
+uint32_t Sky::getParameterHash() const {
+	// Bump when getRadianceAt changes, to invalidate old caches.
+	const uint32_t model_version = 2;
+
+	uint32_t hash = 2166136261u;
+	feedHash(hash, &model_version, sizeof(model_version));
+	feedHash(hash, sun_direction.data(), sizeof(float) * 3);
+	feedHash(hash, sun_power.data(), sizeof(float) * 3);
+	feedHash(hash, &turbidity, sizeof(turbidity));
+	return hash;
+}
+
+std::string Sky::getCachePath(const std::string& cache_dir, int width, int height) const {
+	uint32_t hash = getParameterHash();
+	feedHash(hash, &width, sizeof(width));
+	feedHash(hash, &height, sizeof(height));
+
+	char name[64];
+	std::snprintf(name, sizeof(name), "sky-%dx%d-%08x.bin", width, height, hash);
+	return cache_dir + "/" + name;
 }
 
-Colorf Sky::getRadianceAt(Eigen::Vector3f dir, bool checkerboard) {
-	float theta = std::acos(dir.z());
-	float phi = std::atan2(dir.y(), dir.x());
-	return getRadianceAt(theta, phi, checkerboard);
+Colorf Sky::getRadianceAt(Eigen::Vector3f dir, bool checkerboard) const {
+	if(checkerboard) {
+		float theta = std::acos(dir.z());
+		float phi = std::atan2(dir.y(), dir.x());
+		return getRadianceAt(theta, phi, checkerboard);
+	}
+
+	if(dir.z() < 0) {
+		return Colorf(0, 0, 0);
+	}
+
+	const float cos_view_sun = dir.dot(sun_direction);
+	return
+		(1 + std::pow(cos_view_sun, 2)) * lookupTable(scattering_rayleigh, dir.z()) +
+		std::pow(1 + std::pow(cos_view_sun, 3), 2) * lookupTable(scattering_mie, dir.z());
 }
 
-Colorf Sky::getRadianceAt(float theta, float phi, bool checkerboard) {
+Colorf Sky::getRadianceAt(float theta, float phi, bool checkerboard) const {
 	if(checkerboard) {
 		const int x = theta / (pi / 5);
 		const int y = phi / (pi / 5);
@@ -58,6 +167,89 @@ Colorf Sky::getRadianceAt(float theta, float phi, bool checkerboard) {
 		return Colorf(val, val, val);
 	}
 
+	return getRadianceAt(Eigen::Vector3f(
+		std::sin(theta) * std::cos(phi),
+		std::sin(theta) * std::sin(phi),
+		std::cos(theta)));
+}
+
+void Sky::buildTables() {
+	const float alpha_haze = 0.8333;  // haze: /km
+	const float alpha_mole = 0.1136;  // molecules: /km
+
+	// Same march as getRadianceAtReference, without phase functions.
+	// All directions (table entries) are marched at once; each column is
+	// a direction.
+	const Eigen::RowVectorXf cos_theta =
+		Eigen::RowVectorXf::LinSpaced(table_size, 0, 1);
+	Eigen::Array3Xf accum_mole = Eigen::Array3Xf::Zero(3, table_size);
+	Eigen::Array3Xf accum_haze = Eigen::Array3Xf::Zero(3, table_size);
+	Eigen::Array3Xf decay_here_to_view = Eigen::Array3Xf::Ones(3, table_size);
+	for(int j = 0; j < 50; j++) {
+		const float distance = j;
+		// = particleDensity
+		const Eigen::RowVectorXf density_mole = (-alpha_mole * distance * cos_theta.array()).exp().matrix();
+		const Eigen::RowVectorXf density_haze = (-alpha_haze * distance * cos_theta.array()).exp().matrix();
+
+		accum_mole += decay_here_to_view.rowwise() * density_mole.array();
+		accum_haze += decay_here_to_view.rowwise() * density_haze.array();
+
+		const Eigen::Array3Xf decay_scatter =
+			(rayleigh_total * density_mole + mie_total * density_haze).array();
+		decay_here_to_view *= 1 - decay_scatter;
+	}
+
+	// rayleigh(0) and mie(0) are phase-independent coefficients.
+	const Colorf coeff_rayleigh = sun_power.cwiseProduct(rayleigh(0)) / 100;
+	const Colorf coeff_mie = sun_power.cwiseProduct(mie(0)) / 100;
+	scattering_rayleigh.resize(table_size);
+	scattering_mie.resize(table_size);
+	transmittance.resize(table_size);
+	for(int i = 0; i < table_size; i++) {
+		scattering_rayleigh[i] = coeff_rayleigh.cwiseProduct(accum_mole.col(i).matrix());
+		scattering_mie[i] = coeff_mie.cwiseProduct(accum_haze.col(i).matrix());
+		transmittance[i] = decay_here_to_view.col(i);
+	}
+}
+
+std::vector<Colorf> Sky::getRadianceAt(const std::vector<Eigen::Vector3f>& dirs) const {
+	const int n = dirs.size();
+	std::vector<Colorf> radiances(n);
+	if(n == 0) {
+		return radiances;
+	}
+
+	// Phase functions & table coordinates for all directions at once.
+	const Eigen::Map<const Eigen::Matrix3Xf> dir_mat(dirs[0].data(), 3, n);
+	const Eigen::ArrayXf cos_view_sun = (sun_direction.transpose() * dir_mat).transpose().array();
+	const Eigen::ArrayXf phase_rayleigh = 1 + cos_view_sun.square();
+	const Eigen::ArrayXf phase_mie = (1 + cos_view_sun.cube()).square();
+	const Eigen::ArrayXf z = dir_mat.row(2).transpose().array();
+	const Eigen::ArrayXf f = z.max(0).min(1) * (table_size - 1);
+	const Eigen::ArrayXi index = f.cast<int>().min(table_size - 2);
+	const Eigen::ArrayXf t = f - index.cast<float>();
+
+	for(int i = 0; i < n; i++) {
+		if(z[i] < 0) {
+			radiances[i] = Colorf(0, 0, 0);
+			continue;
+		}
+		const int k = index[i];
+		radiances[i] =
+			phase_rayleigh[i] * ((1 - t[i]) * scattering_rayleigh[k] + t[i] * scattering_rayleigh[k + 1]) +
+			phase_mie[i] * ((1 - t[i]) * scattering_mie[k] + t[i] * scattering_mie[k + 1]);
+	}
+	return radiances;
+}
+
+Colorf Sky::lookupTable(const std::vector<Colorf>& table, float cos_theta) const {
+	const float f = std::min(std::max(cos_theta, 0.0f), 1.0f) * (table_size - 1);
+	const int i = std::min(static_cast<int>(f), table_size - 2);
+	const float t = f - i;
+	return (1 - t) * table[i] + t * table[i + 1];
+}
+
+Colorf Sky::getRadianceAtReference(float theta, float phi) const {
 	if(theta > pi / 2) {
 		return Colorf(0, 0, 0);
 	}
@@ -107,8 +299,8 @@ Colorf Sky::getRadianceAt(float theta, float phi, bool checkerboard) {
 			.cwiseProduct(decay_here_to_view);
 
 		const Colorf decay_scatter =
-			particleDensity(alpha_mole, distance, theta) * rayleighTotal() +
-			particleDensity(alpha_haze, distance, theta) * mieTotal();
+			particleDensity(alpha_mole, distance, theta) * rayleigh_total +
+			particleDensity(alpha_haze, distance, theta) * mie_total;
 
 		decay_here_to_view = decay_here_to_view.cwiseProduct(
 			Colorf(1, 1, 1) - decay_scatter);
@@ -118,21 +310,34 @@ Colorf Sky::getRadianceAt(float theta, float phi, bool checkerboard) {
 	return radiance;
 }
 
-Colorf Sky::rayleighTotal() {
+Eigen::Vector3f Sky::getSunDirection() const {
+	return sun_direction;
+}
+
+Colorf Sky::getSunIrradiance() const {
+	if(sun_direction.z() < 0) {
+		return Colorf(0, 0, 0);
+	}
+
+	// Same decay as view rays in getRadianceAt. Same scale too.
+	return sun_power.cwiseProduct(lookupTable(transmittance, sun_direction.z())) / 100;
+}
+
+Colorf Sky::rayleighTotal() const {
 	return Colorf(
 		rayleighTotal(wl_r),
 		rayleighTotal(wl_g),
 		rayleighTotal(wl_b));
 }
 
-Colorf Sky::mieTotal() {
+Colorf Sky::mieTotal() const {
 	return Colorf(
 		mieTotal(wl_r),
 		mieTotal(wl_g),
 		mieTotal(wl_b));
 }
 
-float Sky::rayleighTotal(float lambda) {
+float Sky::rayleighTotal(float lambda) const {
 	const float n_minus_1 = 0.00003;
 	const float N = 2.545e25;
 	const float pn = 0.035;
@@ -143,7 +348,7 @@ float Sky::rayleighTotal(float lambda) {
 		((6 + 3 * pn) / (6 - 7 * pn));
 }
 
-float Sky::mieTotal(float lambda) {
+float Sky::mieTotal(float lambda) const {
 	assert(1 <= turbidity);
 	const float n = 1.00003;
 	const float c = (0.6544 * turbidity - 0.6510) * 1e-16;
@@ -153,14 +358,14 @@ float Sky::mieTotal(float lambda) {
 		0.67;
 }
 
-Colorf Sky::rayleigh(float cos) {
+Colorf Sky::rayleigh(float cos) const {
 	return Colorf(
 		rayleigh(cos, wl_r),
 		rayleigh(cos, wl_g),
 		rayleigh(cos, wl_b));
 }
 
-Colorf Sky::mie(float cos) {
+Colorf Sky::mie(float cos) const {
 	return Colorf(
 		mie(cos, wl_r),
 		mie(cos, wl_g),
@@ -168,7 +373,7 @@ Colorf Sky::mie(float cos) {
 }
 
 // Taken from Preetham, Appendix.3
-float Sky::rayleigh(float cos, float lambda) {
+float Sky::rayleigh(float cos, float lambda) const {
 	const float n_minus_1 = 0.00003;
 	const float N = 2.545e25;
 	const float pn = 0.035;
@@ -181,7 +386,7 @@ float Sky::rayleigh(float cos, float lambda) {
 
 // Taken from Preetham, Appendix.3 (Wavelength-dependent component is
 // approximated by hand)
-float Sky::mie(float cos, float lambda) {
+float Sky::mie(float cos, float lambda) const {
 	assert(1 <= turbidity);
 	const float n = 1.00003;
 	const float c = (0.6544 * turbidity - 0.6510) * 1e-16;
@@ -192,10 +397,72 @@ float Sky::mie(float cos, float lambda) {
 }
 
 // u(distance) in the paper.
-float Sky::particleDensity(float alpha, float distance, float theta) {
+float Sky::particleDensity(float alpha, float distance, float theta) const {
 	const float view_height = 0;
 	return std::exp(- alpha * (view_height + distance * std::cos(theta)));
 }
 
 
+
+
+SkyRadianceMap::SkyRadianceMap(const Sky& sky, int resolution) :
+	resolution(resolution), texels(resolution * resolution),
+	sun_direction(sky.getSunDirection()), sun_irradiance(sky.getSunIrradiance()) {
+	std::vector<Eigen::Vector3f> dirs(resolution * resolution);
+	for(int y = 0; y < resolution; y++) {
+		for(int x = 0; x < resolution; x++) {
+			const Eigen::Vector2f p(
+				(x + 0.5f) / resolution * 2 - 1,
+				(y + 0.5f) / resolution * 2 - 1);
+			dirs[y * resolution + x] = decode(p);
+		}
+	}
+	texels = sky.getRadianceAt(dirs);
+}
+
+Colorf SkyRadianceMap::getRadianceAt(Eigen::Vector3f dir) const {
+	// Texel centers are at integer coordinates.
+	const Eigen::Vector2f p = (encode(dir).array() + 1) * (resolution / 2.0f) - 0.5f;
+	const float fx = std::min(std::max(p.x(), 0.0f), resolution - 1.0f);
+	const float fy = std::min(std::max(p.y(), 0.0f), resolution - 1.0f);
+	const int x0 = std::min(static_cast<int>(fx), resolution - 2);
+	const int y0 = std::min(static_cast<int>(fy), resolution - 2);
+	const float tx = fx - x0;
+	const float ty = fy - y0;
+
+	const Colorf* row0 = &texels[y0 * resolution + x0];
+	const Colorf* row1 = row0 + resolution;
+	return
+		(1 - ty) * ((1 - tx) * row0[0] + tx * row0[1]) +
+		ty * ((1 - tx) * row1[0] + tx * row1[1]);
+}
+
+Eigen::Vector3f SkyRadianceMap::getSunDirection() const {
+	return sun_direction;
+}
+
+Colorf SkyRadianceMap::getSunIrradiance() const {
+	return sun_irradiance;
+}
+
+Eigen::Vector2f SkyRadianceMap::encode(Eigen::Vector3f dir) {
+	const Eigen::Vector3f d = dir / dir.lpNorm<1>();
+	if(d.z() >= 0) {
+		return Eigen::Vector2f(d.x(), d.y());
+	}
+	// Fold lower hemisphere onto the corners.
+	return Eigen::Vector2f(
+		(1 - std::abs(d.y())) * (d.x() >= 0 ? 1 : -1),
+		(1 - std::abs(d.x())) * (d.y() >= 0 ? 1 : -1));
+}
+
+Eigen::Vector3f SkyRadianceMap::decode(Eigen::Vector2f p) {
+	Eigen::Vector3f d(p.x(), p.y(), 1 - std::abs(p.x()) - std::abs(p.y()));
+	if(d.z() < 0) {
+		d.x() = (1 - std::abs(p.y())) * (p.x() >= 0 ? 1 : -1);
+		d.y() = (1 - std::abs(p.x())) * (p.y() >= 0 ? 1 : -1);
+	}
+	return d.normalized();
+}
+
 }  // namespace
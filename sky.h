@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "gl.h"
 #include "util.h"
@@ -9,37 +12,96 @@ namespace construct {
 
 // Large-scale, non-interactive effects, such as
 // sky, weather, stars, sunlight, fog, etc. comes here.
+//
+// Not thread-safe. Use SkyRadianceMap to share a snapshot with other threads.
 class Sky {
 public:
 	Sky();
 
+	// Move the Sun. Cheap enough to call every frame.
+	void setSunDirection(Eigen::Vector3f dir);
+
 	// Return 1:2 texture
 	// direction spec: TBD
-	std::shared_ptr<Texture> generateEquirectangular();
+	// Loaded from cache_dir when the same sky was generated before.
+	// Otherwise it's generated & stored there (cache_dir is created if needed).
+	// Empty cache_dir disables cache.
+	std::shared_ptr<Texture> generateEquirectangular(const std::string& cache_dir = "cache");
+
+	// RGB float texels of the texture, row major. Uses all cores.
+	std::vector<float> generateEquirectangularData(int width, int height) const;
+
+	// Same as above, but cached in cache_dir like generateEquirectangular.
+	std::vector<float> loadEquirectangularData(const std::string& cache_dir, int width, int height) const;
+
+	// Different for different sky parameters (e.g. position of the Sun).
+	// Anything derived from the sky should be keyed by this.
+	uint32_t getParameterHash() const;
+
+	// Return path of cache file for the texture. Different for different
+	// sky parameters.
+	std::string getCachePath(const std::string& cache_dir, int width, int height) const;
+
+	// Uses precomputed tables; see scattering_rayleigh.
+	Colorf getRadianceAt(float theta, float phi, bool checkerboard = false) const;
+	Colorf getRadianceAt(Eigen::Vector3f dir, bool checkerboard = false) const;
 
-	Colorf getRadianceAt(float theta, float phi, bool checkerboard = false);
-	Colorf getRadianceAt(Eigen::Vector3f dir, bool checkerboard = false);
+	// Same as getRadianceAt(dir) for each dir, but faster.
+	// dirs must be normalized.
+	std::vector<Colorf> getRadianceAt(const std::vector<Eigen::Vector3f>& dirs) const;
+
+	// Same as getRadianceAt, by numerical integration. Slow.
+	Colorf getRadianceAtReference(float theta, float phi) const;
+
+	// Unit vector toward the Sun.
+	Eigen::Vector3f getSunDirection() const;
+
+	// Irradiance on a plane facing the Sun, after atmospheric decay.
+	// Same unit as getRadianceAt.
+	// getRadianceAt doesn't contain the solar disk, so this needs to be added
+	// separately.
+	Colorf getSunIrradiance() const;
 protected:
-	float particleDensity(float alpha, float distance, float theta);
+	float particleDensity(float alpha, float distance, float theta) const;
 
 	// Total Scattering
-	Colorf rayleighTotal();
-	Colorf mieTotal();
+	Colorf rayleighTotal() const;
+	Colorf mieTotal() const;
 	
-	float rayleighTotal(float lambda);
-	float mieTotal(float lambda);
+	float rayleighTotal(float lambda) const;
+	float mieTotal(float lambda) const;
 
 	// Directional scattering
-	Colorf rayleigh(float cos);
-	Colorf mie(float cos);
+	Colorf rayleigh(float cos) const;
+	Colorf mie(float cos) const;
 
-	float rayleigh(float cos, float lambda);
-	float mie(float cos, float lambda);
+	float rayleigh(float cos, float lambda) const;
+	float mie(float cos, float lambda) const;
+
+	void buildTables();
+
+	// Linear interpolation of table at cos(view zenith angle) in [0, 1].
+	Colorf lookupTable(const std::vector<Colorf>& table, float cos_theta) const;
 private:
 	Eigen::Vector3f sun_direction;
 	Colorf sun_power;
 	float turbidity;  // 5:fog 20:hazy 5:clear 1.5:super clear
 
+	// Since we ignore point-to-space decay, the sun only affects phase
+	// functions. So the integral in getRadianceAtReference becomes
+	//   radiance = (1 + cos^2) * scattering_rayleigh(theta) + (1 + cos^3)^2 * scattering_mie(theta)
+	// (cos: between view & sun). Tables are indexed by cos(theta) uniformly,
+	// and are independent from the Sun.
+	std::vector<Colorf> scattering_rayleigh;
+	std::vector<Colorf> scattering_mie;
+	// Decay through the whole atmosphere.
+	std::vector<Colorf> transmittance;
+	const int table_size = 256;
+
+	// Direction-independent coefficients, calculated once.
+	Colorf rayleigh_total;
+	Colorf mie_total;
+
 	// color space
 	// Narest pure colors of sRGB vertices.
 	const float wl_r = 615e-9;
@@ -47,4 +109,31 @@ private:
 	const float wl_b = 465e-9;
 };
 
+
+// Radiance of a Sky for all directions, tabulated for fast lookup.
+// Uses octahedral mapping (no singularity at poles) and bilinear filtering.
+// Immutable, so it can be shared between threads.
+class SkyRadianceMap {
+public:
+	// resolution: texels per edge.
+	SkyRadianceMap(const Sky& sky, int resolution = 128);
+
+	// Approximately same as Sky::getRadianceAt(dir). dir must be normalized.
+	Colorf getRadianceAt(Eigen::Vector3f dir) const;
+
+	// Same as Sky's at the time of construction.
+	Eigen::Vector3f getSunDirection() const;
+	Colorf getSunIrradiance() const;
+private:
+	// Octahedral mapping between unit vector and [-1, 1]^2.
+	static Eigen::Vector2f encode(Eigen::Vector3f dir);
+	static Eigen::Vector3f decode(Eigen::Vector2f p);
+private:
+	int resolution;
+	std::vector<Colorf> texels;
+
+	Eigen::Vector3f sun_direction;
+	Colorf sun_irradiance;
+};
+
 }  // namespace